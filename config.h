@@ -17,15 +17,19 @@
 #define DISPLAY_SCLK_PIN 5
 #define DISPLAY_SOUT_PIN 7
 #define DISPLAY_XLAT_PIN 4
-#define DISPLAY_DRE_vect USARTC1_DRE_vect
 #define DISPLAY_TXC_vect USARTC1_TXC_vect
 #define DISPLAY_BSEL 8
 #define DISPLAY_SIZE 8
 
+// DMA channel feeding the display USART, triggered by its DRE
+#define DISPLAY_DMA DMA.CH1
+#define DISPLAY_DMA_TRIGSRC DMA_CH_TRIGSRC_USARTC1_DRE_gc
+
 /**
  * 1WB to TWI bridge configuration
  */
 #define ONEWIRE_TWI TWIC
+#define ONEWIRE_TWI_PORT PORTC
 #define ONEWIRE_TWI_BAUD 35
 #define ONEWIRE_TWI_ISR ISR(TWIC_TWIM_vect)
 #define ONEWIRE_SLPZ_PORT PORTC
@@ -35,8 +39,25 @@
  * Temperature configuration
  */
 
-//check the temperature every ... seconds
-#define TEMP_SECONDS 1
+//put the DS2483 to sleep (SLPZ low) while waiting for a conversion
+#define TEMP_ONEWIRE_SLEEP 1
+
+//check the temperature every ... milliseconds, and the resolution in bits
+//(9-12), until changed with temp_set_period() and temp_set_resolution()
+#define TEMP_PERIOD_MS 1000
+#define TEMP_RESOLUTION 12
+
+//stop reading the scratchpad after the configuration register, skipping
+//its CRC: 4 bytes less per sensor, but corrupted readings go unnoticed
+#define TEMP_SHORT_READ 0
+
+//DS18B20 sensors sharing the 1-Wire bus; the first one controls the bath
+#define TEMP_MAX_SENSORS 3
+
+//run the sampler on a thread of its own (woken with thread_signal()) instead
+//of from a task: costs a stack, but the sampler no longer waits behind the
+//tasks queued ahead of it
+#define TEMP_THREAD 0
 
 
 /***************************************
@@ -62,15 +83,15 @@
 
 /**
  * In order to kill contact bounce, when a keypress is detected, the keys are
- * scanned KEYPAD_SCAN_SAMPLES every KEYPAD_SCAN_DELAY milliseconds. This
- * happens twice: once for the rows, once for the cols. Thus delay=5, samples
- * = 3 => 30ms spent reading a key.
+ * scanned KEYPAD_SCAN_SAMPLES every KEYPAD_SCAN_DELAY. This happens twice:
+ * once for the rows, once for the cols. Thus delay=5ms, samples = 3 => 30ms
+ * spent reading a key. Delays are RTC ticks, converted with TIMER_MS().
  */
-#define KEYPAD_SCAN_DELAY 5
+#define KEYPAD_SCAN_DELAY TIMER_MS(5)
 #define KEYPAD_SCAN_SAMPLES 3
 
-//after keypress is recorded, ignore keypresses for this many milliseconds
-#define KEYPAD_REPEAT_RATE 250
+//after keypress is recorded, ignore keypresses for this long
+#define KEYPAD_REPEAT_RATE TIMER_MS(250)
 
 /**
  * Alarm Configuration
@@ -79,4 +100,83 @@
 #define ALARM_PORT PORTD
 #define ALARM_PIN 0
 
+
+/**
+ * Stopwatch (free-running 32 bit counter) configuration. The low timer's
+ * overflow clocks the high timer through an event channel.
+ */
+#define STOPWATCH_TC_LOW TCD1
+#define STOPWATCH_TC_HIGH TCE0
+#define STOPWATCH_EVSYS_MUX EVSYS.CH0MUX
+#define STOPWATCH_EVSYS_SRC EVSYS_CHMUX_TCD1_OVF_gc
+#define STOPWATCH_EVSYS_CLKSEL TC_CLKSEL_EVCH0_gc
+
+/**
+ * High resolution timer (see hrtimer.h): its compare interrupt runs the
+ * callbacks.
+ */
+#define HRTIMER_TC TCD0
+#define HRTIMER_vect TCD0_CCA_vect
+#define HRTIMER_INTLVL TC_CCAINTLVL_MED_gc
+
+/**
+ * Idle configuration
+ */
+
+// The TWI, USART and TC peripherals (and the stopwatch) only run in IDLE.
+#define CONFIG_IDLE_SLEEP_MODE SLEEP_MODE_IDLE
+
+/**
+ * Thread preemption (off by default). A thread other than main that runs for
+ * THREADS_QUANTUM_MS without blocking is switched out from the overflow
+ * interrupt of THREADS_PREEMPT_TC and main runs tasks again. The quantum is
+ * in ms (at most 2000).
+ */
+#define THREADS_PREEMPT 0
+#define THREADS_QUANTUM_MS 10
+#define THREADS_PREEMPT_TC TCC1
+#define THREADS_PREEMPT_vect TCC1_OVF_vect
+
+/**
+ * Preemption test (needs THREADS_PREEMPT): a low priority thread that spins
+ * for THREADS_PREEMPT_TEST_QUANTA quanta each time THREADS_PREEMPT_TEST_CMD
+ * is received on the debug port. The 'R' report then shows the preemptions
+ * and the longest time a thread kept main off the CPU, which should stay
+ * just above THREADS_QUANTUM_MS.
+ */
+#define THREADS_PREEMPT_TEST 0
+#define THREADS_PREEMPT_TEST_CMD 'q'
+#define THREADS_PREEMPT_TEST_QUANTA 4
+
+/**
+ * Debug reporting
+ */
+
+// write the idle percentage and thread stack usage every ... seconds
+#define DEBUG_REPORT_SECONDS 10
+
+// maximum number of single byte commands accepted on the debug port
+#define DEBUG_MAX_COMMANDS 4
+
+// DMA channel feeding the debug port transmitter
+#define DEBUG_DMA DMA.CH0
+#define DEBUG_DMA_vect DMA_CH0_vect
+
+/**
+ * Task profiler: measures queue wait and run time of each callback. The
+ * statistics are written to the debug port when TASKS_PROFILE_DUMP_CMD is
+ * received. Costs about 40 bytes of SRAM per slot.
+ */
+#define TASKS_PROFILE 0
+#define TASKS_PROFILE_SLOTS 8
+#define TASKS_PROFILE_DUMP_CMD 'p'
+
+/**
+ * Timer interrupt profiler: the number of RTC compare interrupts and the
+ * worst case duration of the RTC interrupt, by power of two of armed timers,
+ * are added to the periodic report. Build with a larger MAX_TIMERS to see
+ * how the interrupt scales.
+ */
+#define TIMER_PROFILE 0
+
 #endif
@@ -0,0 +1,69 @@
+#include <stdint.h>
+
+#ifndef CORO_H
+#define CORO_H
+
+/**
+ * Stackless coroutines (switch-resume, as in protothreads).
+ *
+ * A coroutine is a function returning CORO_WAITING or CORO_DONE, whose body
+ * is enclosed in CORO_BEGIN()/CORO_END(). When it has to wait it records its
+ * position in a coro_t and returns CORO_WAITING; the next call resumes at
+ * that position. Coroutines are driven by tasks: whatever completes the
+ * awaited event (an ISR, a timer) queues the task that calls the coroutine
+ * again.
+ *
+ * Local variables are NOT preserved across a wait: keep state in statics or
+ * in the driver structure. switch statements cannot be used in a coroutine
+ * body (CORO_* macros expand to case labels).
+ */
+typedef struct {
+	uint16_t lc;
+} coro_t;
+
+#define CORO_WAITING 0
+#define CORO_DONE 1
+
+#define CORO_INIT(co) ((co)->lc = 0)
+
+#define CORO_BEGIN(co) switch ((co)->lc) { case 0:
+
+#define CORO_END(co) } (co)->lc = 0; return CORO_DONE
+
+/**
+ * Return to the caller until cond is true. cond is evaluated each time the
+ * coroutine is called.
+ */
+#define CORO_WAIT_UNTIL(co, cond) do { \
+		(co)->lc = __LINE__; case __LINE__: \
+		if (!(cond)) \
+			return CORO_WAITING; \
+	} while (0)
+
+/**
+ * Return to the caller once, resuming here on the next call.
+ */
+#define CORO_YIELD(co) do { \
+		(co)->lc = __LINE__; \
+		return CORO_WAITING; \
+		case __LINE__:; \
+	} while (0)
+
+/**
+ * Run a child coroutine until it is done. call is the child coroutine call;
+ * child is the coro_t it uses, which is reset first.
+ */
+#define CORO_SPAWN(co, child, call) do { \
+		CORO_INIT(child); \
+		CORO_WAIT_UNTIL(co, (call) != CORO_WAITING); \
+	} while (0)
+
+/**
+ * Finish the coroutine early.
+ */
+#define CORO_EXIT(co) do { \
+		(co)->lc = 0; \
+		return CORO_DONE; \
+	} while (0)
+
+#endif
@@ -1,29 +1,43 @@
 #include <avr/io.h>
 #include <util/atomic.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 
 #include "mempool.h"
 #include "debug.h"
 #include "queue.h"
+#include "tasks.h"
+#include "error.h"
+#include "config.h"
 
-#define QUEUE_SIZE 5
-#define DEBUG_MAX_LEN 32
+#define POOL_SIZE 5
+//power of two >= POOL_SIZE
+#define QUEUE_SIZE 8
+#define DEBUG_POOL_REPORT_ID 'D'
+#define DEBUG_REPORT_TAG 'U'
+
+//115200 baud at 32MHz (0.01% error)
+#define DEBUG_BSEL 2094
+#define DEBUG_BSCALE -7
 
 typedef struct {
 	uint8_t size;
 	uint8_t data[DEBUG_MAX_LEN];
 } uart_buf;
 
-static void uart_begin_tx(void);
+#define uart_buf_of(data) ((uart_buf *)((uint8_t *)(data) - offsetof(uart_buf, data)))
 
-static void uart_tx_interrupt_enable(void) {
-	USARTD0.CTRLA |= USART_DREINTLVL_LO_gc;
-}
+/**
+ * Buffers are queued by debug_send() (task context) and taken, with
+ * interrupts disabled, by debug_send() when the transmitter is idle or by
+ * the DMA interrupt at the end of each frame. The DMA channel moves a whole
+ * buffer to the USART, one byte per DRE, straight from the pool; its
+ * reference is dropped when the transfer completes.
+ */
+QUEUE_TYPE(uart_queue, uart_buf *, QUEUE_SIZE)
 
-static void uart_tx_interrupt_disable(void) {
-	USARTD0.CTRLA &= ~USART_DREINTLVL_LO_gc;
-}
+static void uart_begin_tx(void);
 
 typedef struct {
 	volatile enum {
@@ -31,70 +45,207 @@ typedef struct {
 		UART_STATUS_BUSY
 	} status;
 
-	mempool_t *pool;
-	queue_t *queue;
-
-	uint8_t buf_pos;
+	uart_queue_t queue;
 	uart_buf *buf;
+
+	//frames (one interrupt each) and bytes sent, frames dropped
+	uint16_t frames;
+	uint16_t bytes;
+	uint16_t drops;
 } uart_t;
 
 static uart_t uart;
 
+MEMPOOL_DEFINE(pool, uart_buf, POOL_SIZE);
+
+static struct {
+	uint8_t cmd;
+	void (*handler)(void);
+} commands[DEBUG_MAX_COMMANDS];
+
 void debug_init(void) {
 
-	uint16_t bsel = 3332;
-	int8_t bscale = -4;
+	uint16_t bsel = DEBUG_BSEL;
+	int8_t bscale = DEBUG_BSCALE;
 
 	//BSEL
 	USARTD0.BAUDCTRLA = (uint8_t)( bsel & 0x00FF );
 	USARTD0.BAUDCTRLB = (bscale<<USART_BSCALE_gp) | (uint8_t)( (bsel>>8) & 0x0F ) ;
 
 	USARTD0.CTRLC |= USART_PMODE_DISABLED_gc | USART_CHSIZE_8BIT_gc;
-	USARTD0.CTRLB |= USART_TXEN_bm;
+	USARTD0.CTRLB |= USART_TXEN_bm | USART_RXEN_bm;
+	USARTD0.CTRLA |= USART_RXCINTLVL_LO_gc;
 
 	//xmegaA, p237
 	PORTD.OUTSET = PIN3_bm;
 	PORTD.DIRSET = PIN3_bm;
 
-	uart.pool = init_mempool(sizeof(uart_buf),QUEUE_SIZE);
-	uart.queue = queue_create(QUEUE_SIZE);
+	MEMPOOL_INIT(pool);
+
+	//one byte per DRE, from the buffer to the (fixed) data register
+	DMA.CTRL |= DMA_ENABLE_bm;
+	DEBUG_DMA.ADDRCTRL = DMA_CH_SRCRELOAD_NONE_gc | DMA_CH_SRCDIR_INC_gc |
+		DMA_CH_DESTRELOAD_NONE_gc | DMA_CH_DESTDIR_FIXED_gc;
+	DEBUG_DMA.TRIGSRC = DMA_CH_TRIGSRC_USARTD0_DRE_gc;
+	DEBUG_DMA.DESTADDR0 = (uint16_t)&USARTD0.DATA & 0xFF;
+	DEBUG_DMA.DESTADDR1 = (uint16_t)&USARTD0.DATA >> 8;
+	DEBUG_DMA.DESTADDR2 = 0;
+}
+
+/**
+ * Register a handler for a single byte command received on the debug port.
+ * The handler runs as a TASK_PRIO_LOW task.
+ *
+ * @return 0 on success, -ENOMEM if DEBUG_MAX_COMMANDS are registered.
+ */
+int8_t debug_register_command(uint8_t cmd, void (*handler)(void)) {
+	for (uint8_t i = 0; i < DEBUG_MAX_COMMANDS; ++i) {
+		if (commands[i].handler == NULL) {
+			commands[i].cmd = cmd;
+			commands[i].handler = handler;
+			return 0;
+		}
+	}
+
+	return -ENOMEM;
+}
+
+/**
+ * Write the usage of the buffer pool, as a mempool_report(), and the
+ * transmitter statistics: frames and bytes sent and frames dropped since the
+ * last report.
+ */
+void debug_report(void) {
+	struct {
+		uint8_t tag;
+		uint16_t frames;
+		uint16_t bytes;
+		uint16_t drops;
+	} report = { DEBUG_REPORT_TAG };
+
+	mempool_report(pool, DEBUG_POOL_REPORT_ID);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		report.frames = uart.frames;
+		report.bytes = uart.bytes;
+		report.drops = uart.drops;
+		uart.frames = 0;
+		uart.bytes = 0;
+		uart.drops = 0;
+	}
+
+	DEBUG_CHECK_LEN(report);
+	debug_write(&report, sizeof(report));
 }
 
 //call with interrupts disabled
 static void uart_begin_tx(void) {
-	uart_buf *buf = queue_poll(uart.queue);	
+	uart_buf *buf;
 
-	if (buf == NULL) {
+	if (!uart_queue_poll(&uart.queue, &buf)) {
 		uart.status = UART_STATUS_IDLE;
 		return;
 	}
 
 	uart.status = UART_STATUS_BUSY;
 	uart.buf = buf;
-	uart.buf_pos = 0;
-	uart_tx_interrupt_enable();
+
+	DEBUG_DMA.SRCADDR0 = (uint16_t)buf->data & 0xFF;
+	DEBUG_DMA.SRCADDR1 = (uint16_t)buf->data >> 8;
+	DEBUG_DMA.SRCADDR2 = 0;
+	DEBUG_DMA.TRFCNT = buf->size;
+	DEBUG_DMA.CTRLB = DMA_CH_TRNIF_bm | DMA_CH_ERRIF_bm | DMA_CH_TRNINTLVL_LO_gc | DMA_CH_ERRINTLVL_LO_gc;
+	DEBUG_DMA.CTRLA = DMA_CH_ENABLE_bm | DMA_CH_SINGLE_bm | DMA_CH_BURSTLEN_1BYTE_gc;
+}
+
+/**
+ * Get a buffer of DEBUG_MAX_LEN bytes to build a message in, for
+ * debug_send(). Safe from interrupts.
+ *
+ * @return the buffer, or NULL if none is free: the message is counted as
+ * dropped.
+ */
+void *__debug_alloc(void) {
+	uart_buf *buf = mempool_alloc(pool);
+
+	if (buf == NULL) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			uart.drops++;
+		}
+		return NULL;
+	}
+
+	return buf->data;
 }
 
-void __debug_write(void *data, uint8_t size) {
-	uart_buf *buf = mempool_alloc(uart.pool);
-	memcpy((void*)(buf->data),data,size);
+/**
+ * Queue size bytes of a buffer from debug_alloc() for transmission. The
+ * buffer is handed over: it is freed once sent.
+ */
+void __debug_send(void *data, uint8_t size) {
+	uart_buf *buf = uart_buf_of(data);
+
 	buf->size = size;
-	queue_offer(uart.queue,buf);
 
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		if (uart.status == UART_STATUS_IDLE)
+		if (!uart_queue_offer(&uart.queue, buf)) {
+			uart.drops++;
+			mempool_putref(pool, buf);
+		} else if (uart.status == UART_STATUS_IDLE) {
 			uart_begin_tx();
+		}
 	}
 }
 
-ISR(USARTD0_DRE_vect) {
-	USARTD0.DATA = uart.buf->data[uart.buf_pos];
+/**
+ * Copy size bytes (at most DEBUG_MAX_LEN) into a buffer and queue it.
+ *
+ * @return 0, -EINVAL if the message is too long or -ENOMEM if it was
+ * dropped for lack of a buffer. Either way it is counted as dropped.
+ */
+int8_t __debug_write(void *data, uint8_t size) {
+	void *buf;
+
+	if (size > DEBUG_MAX_LEN) {
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			uart.drops++;
+		}
+		return -EINVAL;
+	}
+
+	buf = __debug_alloc();
+	if (buf == NULL)
+		return -ENOMEM;
+
+	memcpy(buf, data, size);
+	__debug_send(buf, size);
+	return 0;
+}
+
+/**
+ * End of a frame: free its buffer and start the next one. A frame that
+ * failed is counted as dropped.
+ */
+ISR(DEBUG_DMA_vect) {
+	if (DEBUG_DMA.CTRLB & DMA_CH_ERRIF_bm)
+		uart.drops++;
+	else
+		uart.bytes += uart.buf->size;
+	uart.frames++;
+
+	DEBUG_DMA.CTRLB |= DMA_CH_TRNIF_bm | DMA_CH_ERRIF_bm;
+	mempool_putref(pool, uart.buf);
+
+	uart_begin_tx();
+}
 
-	if (++uart.buf_pos >= uart.buf->size) {
-		mempool_putref(uart.buf);
-		uart_tx_interrupt_disable();
+ISR(USARTD0_RXC_vect) {
+	uint8_t cmd = USARTD0.DATA;
 
-		//begin another transfer is there is one queued
-		uart_begin_tx();
+	for (uint8_t i = 0; i < DEBUG_MAX_COMMANDS && commands[i].handler != NULL; ++i) {
+		if (commands[i].cmd == cmd) {
+			task_schedule_prio(commands[i].handler, TASK_PRIO_LOW | TASK_COALESCE);
+			break;
+		}
 	}
 }
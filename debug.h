@@ -1,12 +1,50 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
+#include <stdint.h>
+#include <stddef.h>
+
+//largest message
+#define DEBUG_MAX_LEN 32
+
+/**
+ * Fail the build if a fixed-size record is too long to be sent.
+ */
+#define DEBUG_CHECK_LEN(record) \
+	_Static_assert(sizeof(record) <= DEBUG_MAX_LEN, "debug record longer than DEBUG_MAX_LEN")
+
 void debug_init(void);
-void __debug_write(void *str,const uint8_t size);
+int8_t debug_register_command(uint8_t cmd, void (*handler)(void));
+void debug_report(void);
+int8_t __debug_write(void *str,const uint8_t size);
+void *__debug_alloc(void);
+void __debug_send(void *buf, uint8_t size);
+
+/**
+ * Messages are sent from buffers of a pool. debug_write() copies data into
+ * one; to avoid the copy, build the message in a buffer from debug_alloc()
+ * and pass it to debug_send(). When no buffer is free the message is
+ * dropped and counted (see debug_report()).
+ */
+static inline int8_t debug_write(void *data,const uint8_t size) {
+#ifdef DEBUG
+	return __debug_write(data,size);
+#else
+	return 0;
+#endif
+}
+
+static inline void *debug_alloc(void) {
+#ifdef DEBUG
+	return __debug_alloc();
+#else
+	return NULL;
+#endif
+}
 
-static inline void debug_write(void *data,const uint8_t size) {
+static inline void debug_send(void *buf, uint8_t size) {
 #ifdef DEBUG
-	__debug_write(data,size);
+	__debug_send(buf, size);
 #endif
 }
 
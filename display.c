@@ -11,7 +11,6 @@
 #define _XLAT_bm DISPLAY_PIN(DISPLAY_XLAT_PIN)
 
 static inline void xlat_trigger(void);
-static inline void display_write_byte(void);
 static void display_puts(char str[]);
 static void display_write(void);
 static uint8_t get_mapped_char(char);
@@ -60,20 +59,16 @@ static const uint8_t display_charmap[][2] = {
 
 };
 
+/**
+ * The frame is shifted out by the DISPLAY_DMA channel, one byte per DRE of
+ * the USART, straight from buf. The only interrupt is TXC, at the end of the
+ * frame, which latches the shift registers.
+ */
 typedef struct {
-	uint8_t bytes;
 	uint8_t buf[DISPLAY_SIZE];
 } display_state_t;
 static display_state_t state;
 
-static void uart_tx_interrupt_enable(void) {
-	DISPLAY_USART.CTRLA |= USART_DREINTLVL_LO_gc;
-}
-
-static void uart_tx_interrupt_disable(void) {
-	DISPLAY_USART.CTRLA &= ~USART_DREINTLVL_LO_gc;
-}
-
 /**
  * Given a character (c), return the segments required to display c
  */
@@ -153,10 +148,6 @@ static inline void xlat_trigger() {
 	DISPLAY_PIN_LOW(DISPLAY_XLAT_PIN);
 }
 
-static inline void display_write_byte(void) {
-	DISPLAY_USART.DATA = state.buf[state.bytes++];
-}
-
 static void display_write() {
 	//It is possible to call this while the previous data is still being
 	//written to the display. However, since the display is a giant shift
@@ -166,18 +157,18 @@ static void display_write() {
 	//never be displayed. It is, however, possible that some bytes from the
 	//current buffer have been written, then the buffer is replaced, and then
 	//the remaining byte is written out before this runs. This is unlikely.
+	//A transfer in progress is stopped (after its current byte) and
+	//restarted from the first byte.
 
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		uart_tx_interrupt_enable();
-		state.bytes = 0;
-	}
-}
-
-ISR(DISPLAY_DRE_vect) {
-	display_write_byte();
-
-	if (state.bytes == DISPLAY_SIZE) {
-		uart_tx_interrupt_disable();
+		DISPLAY_DMA.CTRLA &= ~DMA_CH_ENABLE_bm;
+		while (DISPLAY_DMA.CTRLA & DMA_CH_ENABLE_bm);
+
+		DISPLAY_DMA.SRCADDR0 = (uint16_t)state.buf & 0xFF;
+		DISPLAY_DMA.SRCADDR1 = (uint16_t)state.buf >> 8;
+		DISPLAY_DMA.SRCADDR2 = 0;
+		DISPLAY_DMA.TRFCNT = DISPLAY_SIZE;
+		DISPLAY_DMA.CTRLA = DMA_CH_ENABLE_bm | DMA_CH_SINGLE_bm | DMA_CH_BURSTLEN_1BYTE_gc;
 	}
 }
 
@@ -202,7 +193,14 @@ void display_init() {
 	DISPLAY_PORT.OUTSET = _SOUT_bm;
 	DISPLAY_PORT.OUTCLR = _XLAT_bm;
 
-	state.bytes = 0;
+	//one byte per DRE, from the buffer to the (fixed) data register
+	DMA.CTRL |= DMA_ENABLE_bm;
+	DISPLAY_DMA.ADDRCTRL = DMA_CH_SRCRELOAD_NONE_gc | DMA_CH_SRCDIR_INC_gc |
+		DMA_CH_DESTRELOAD_NONE_gc | DMA_CH_DESTDIR_FIXED_gc;
+	DISPLAY_DMA.TRIGSRC = DISPLAY_DMA_TRIGSRC;
+	DISPLAY_DMA.DESTADDR0 = (uint16_t)&DISPLAY_USART.DATA & 0xFF;
+	DISPLAY_DMA.DESTADDR1 = (uint16_t)&DISPLAY_USART.DATA >> 8;
+	DISPLAY_DMA.DESTADDR2 = 0;
 
 	for (uint8_t i = 0; i < DISPLAY_SIZE; ++i)
 		state.buf[i] = 0;
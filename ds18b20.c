@@ -1,65 +1,221 @@
+#include <stddef.h>
+#include <string.h>
 #include <util/crc16.h>
 #include "ds18b20.h"
 #include "ds2483.h"
 #include "error.h"
 
-//applicable when there is only ONE one wire device on the bus!
-#define DS18B2O_CMD_SKIP_ROM 0xCC
+#define DS18B2O_FAMILY 0x28
 #define DS18B2O_CMD_READ_SCRATCHPAD 0xBE
 #define DS18B2O_CMD_WRITE_SCRATCHPAD 0x4E
 #define DS18B2O_CMD_CONVERT_T 0x44
 
-static int8_t ds18b20_write_config(ds2483_dev_t *onewiredev);
+//scratchpad bytes 2 and 3 (TH, TL) written with the configuration and
+//checked on read
+#define DS18B2O_MARKER 0x13
+//configuration register: resolution in bits 5-6, the others read as 1
+#define DS18B2O_CONFIG(bits) ((((bits) - DS18B20_MIN_BITS) << 5) | 0x1F)
 
-int8_t ds18b20_start_conversion(ds2483_dev_t *onewiredev) {
-	int8_t err = ds18b20_write_config(onewiredev);
+//scratchpad: temperature (2 bytes), TH, TL, configuration, 3 reserved, CRC
+#define DS18B2O_SCRATCHPAD_SIZE 9
+#define DS18B2O_SCRATCHPAD_TH 2
+#define DS18B2O_SCRATCHPAD_CONFIG 4
 
-	if (err)
-		return err;
-
-	if (!ds2483_1w_rst(onewiredev))
-		return -ENODEV;
-
-	ds2483_1w_write(onewiredev, DS18B2O_CMD_SKIP_ROM);
-	ds2483_1w_write(onewiredev, DS18B2O_CMD_CONVERT_T);
+/**
+ * A command is a select script followed by an operation script: the select
+ * script resets the bus and addresses the devices, the operation script
+ * talks to them.
+ */
+//every device on the bus, or the only one
+static const uint8_t skip_script[] = {
+	DS2483_OP_RESET,
+	DS2483_OP_WRITE, ONEWIRE_CMD_SKIP_ROM,
+	DS2483_OP_END
+};
+
+//the device whose ROM is the script input
+static const uint8_t match_script[] = {
+	DS2483_OP_RESET,
+	DS2483_OP_WRITE, ONEWIRE_CMD_MATCH_ROM,
+	DS2483_OP_WRITE_IN, ONEWIRE_ROM_SIZE,
+	DS2483_OP_END
+};
+
+static const uint8_t config_script[] = {
+	DS2483_OP_WRITE, DS18B2O_CMD_WRITE_SCRATCHPAD,
+	DS2483_OP_WRITE_IN, 3,
+	DS2483_OP_END
+};
+
+static const uint8_t convert_script[] = {
+	DS2483_OP_WRITE, DS18B2O_CMD_CONVERT_T,
+	DS2483_OP_END
+};
+
+//the whole scratchpad, for its CRC
+static const uint8_t read_script[] = {
+	DS2483_OP_WRITE, DS18B2O_CMD_READ_SCRATCHPAD,
+	DS2483_OP_READ_N, DS18B2O_SCRATCHPAD_SIZE,
+	DS2483_OP_END
+};
+
+//up to the configuration: the next reset ends the read
+static const uint8_t read_short_script[] = {
+	DS2483_OP_WRITE, DS18B2O_CMD_READ_SCRATCHPAD,
+	DS2483_OP_READ_N, DS18B2O_SCRATCHPAD_CONFIG + 1,
+	DS2483_OP_END
+};
+
+//TH, TL and configuration written by config_script
+static uint8_t config[3] = { DS18B2O_MARKER, DS18B2O_MARKER };
+
+//bytes read by the read scripts
+static uint8_t scratchpad[DS18B2O_SCRATCHPAD_SIZE];
+
+//state of ds18b20_find(): the search and the last ROM it found
+static coro_t search_co;
+static uint8_t search_rom[ONEWIRE_ROM_SIZE];
 
-	return 0;
+/**
+ * Find the DS18B20s on the bus with a ROM search.
+ *
+ * @param roms set to the ROMs of up to max devices found
+ * @param n set to the number of devices found
+ * @param err set to 0 or a negative error code when done. Devices found
+ * before an error are kept.
+ */
+int8_t ds18b20_find(coro_t * co, ds2483_dev_t * onewiredev,
+		uint8_t (*roms)[ONEWIRE_ROM_SIZE], uint8_t max, uint8_t * n, int8_t * err) {
+	CORO_BEGIN(co);
+
+	*n = 0;
+	*err = 0;
+	ds2483_1w_search_reset(onewiredev);
+
+	while (*n < max) {
+		CORO_SPAWN(co, &search_co, ds2483_1w_search(&search_co, onewiredev, search_rom));
+		if (onewiredev->error == -ENODEV)
+			break;
+		if (onewiredev->error) {
+			*err = onewiredev->error;
+			break;
+		}
+
+		if (search_rom[0] == DS18B2O_FAMILY)
+			memcpy(roms[(*n)++], search_rom, ONEWIRE_ROM_SIZE);
+	}
+
+	CORO_END(co);
 }
 
 /**
- * This is writing data to the scratchpad to verify on read. i.e. if the data
- * comes back different, teh device lost power. This is to attempt to account
- * for the default temperature of 85C on boot. (Even the CRC is valid in this case???)
+ * Start a temperature conversion, on all the devices of the bus at once.
+ *
+ * The configuration, with the resolution of the session, is written first
+ * only if it is not known to be in place: at the start of the session, when
+ * the resolution changed, or when a read found that a device lost it. TH and TL
+ * hold a marker that a device powering up replaces with its EEPROM values.
+ *
+ * @param err set to 0 or a negative error code when done.
  */
-static int8_t ds18b20_write_config(ds2483_dev_t *onewiredev) {
-	if (!ds2483_1w_rst(onewiredev))
-		return -ENODEV;
-
-	ds2483_1w_write(onewiredev, DS18B2O_CMD_SKIP_ROM);
-	ds2483_1w_write(onewiredev, DS18B2O_CMD_WRITE_SCRATCHPAD);
-	ds2483_1w_write(onewiredev, 0x13);
-	ds2483_1w_write(onewiredev, 0x13);
-	ds2483_1w_write(onewiredev, 0b01111111);
-	return 0;
+int8_t ds18b20_start_conversion(coro_t * co, ds2483_dev_t * onewiredev,
+		ds18b20_session_t * session, int8_t * err) {
+	CORO_BEGIN(co);
+
+	if (session->bits < DS18B20_MIN_BITS || session->bits > DS18B20_MAX_BITS) {
+		*err = -EINVAL;
+		CORO_EXIT(co);
+	}
+
+	if (session->lost || session->written != session->bits) {
+		config[2] = DS18B2O_CONFIG(session->bits);
+		CORO_SPAWN(co, &onewiredev->op, ds2483_1w_script(onewiredev, skip_script, NULL, NULL));
+		if (!onewiredev->error)
+			CORO_SPAWN(co, &onewiredev->op, ds2483_1w_script(onewiredev, config_script, config, NULL));
+		*err = onewiredev->error;
+		if (*err)
+			CORO_EXIT(co);
+		session->written = session->bits;
+		session->lost = 0;
+	}
+
+	CORO_SPAWN(co, &onewiredev->op, ds2483_1w_script(onewiredev, skip_script, NULL, NULL));
+	if (!onewiredev->error)
+		CORO_SPAWN(co, &onewiredev->op, ds2483_1w_script(onewiredev, convert_script, NULL, NULL));
+	*err = onewiredev->error;
+
+	CORO_END(co);
 }
 
+/**
+ * Check whether the conversion is complete with a read time slot: devices
+ * hold the bus low while they convert. Requires devices that are not
+ * parasite powered.
+ *
+ * @param done set to 1 once every device on the bus has completed
+ * @param err set to 0 or a negative error code when done.
+ */
+int8_t ds18b20_poll_conversion(coro_t * co, ds2483_dev_t * onewiredev, uint8_t * done, int8_t * err) {
+	CORO_BEGIN(co);
 
-int8_t ds18b20_read_temp(ds2483_dev_t *onewiredev, int16_t *temp) {
-	if (!ds2483_1w_rst(onewiredev))
-		return -ENODEV;
-
-	ds2483_1w_write(onewiredev, DS18B2O_CMD_SKIP_ROM);
-	ds2483_1w_write(onewiredev, DS18B2O_CMD_READ_SCRATCHPAD);
+	CORO_SPAWN(co, &onewiredev->op, ds2483_1w_bit(onewiredev, 1));
+	*err = onewiredev->error;
+	*done = !*err && (onewiredev->result & DS2483_STATUS_SBR);
 
-	uint8_t low = ds2483_1w_read_byte(onewiredev);
-	uint8_t high = ds2483_1w_read_byte(onewiredev);
-	uint8_t chk = ds2483_1w_read_byte(onewiredev);
+	CORO_END(co);
+}
 
-	if (chk != 0x13)
-		return -EINVAL;
+/**
+ * Read the result of a conversion.
+ *
+ * The whole scratchpad is read and checked against its CRC. With short set,
+ * the read stops after the configuration register, without a CRC to check,
+ * saving 4 bytes. Either way, a device whose TH, TL and configuration are
+ * not those last written lost power: it is reconfigured by the next
+ * ds18b20_start_conversion() and its reading is discarded.
+ *
+ * @param rom the device to read, or NULL if it is alone on the bus
+ * @param temp set to the temperature in 1/16th C. Only valid if *err is 0.
+ * @param err set to 0 or a negative error code when done: -EINVAL if the
+ * CRC does not match, -EAGAIN if the device lost power.
+ */
+int8_t ds18b20_read_temp(coro_t * co, ds2483_dev_t * onewiredev, ds18b20_session_t * session,
+		const uint8_t * rom, uint8_t short_read, int16_t * temp, int8_t * err) {
+	uint8_t crc, i;
+
+	CORO_BEGIN(co);
+
+	CORO_SPAWN(co, &onewiredev->op, ds2483_1w_script(onewiredev,
+				rom ? match_script : skip_script, rom, NULL));
+	if (!onewiredev->error)
+		CORO_SPAWN(co, &onewiredev->op, ds2483_1w_script(onewiredev,
+					short_read ? read_short_script : read_script, NULL, scratchpad));
+	*err = onewiredev->error;
+	if (*err)
+		CORO_EXIT(co);
+
+	//the CRC of data followed by its CRC is 0
+	if (!short_read) {
+		crc = 0;
+		for (i = 0; i < DS18B2O_SCRATCHPAD_SIZE; ++i)
+			crc = _crc_ibutton_update(crc, scratchpad[i]);
+		if (crc) {
+			*err = -EINVAL;
+			CORO_EXIT(co);
+		}
+	}
+
+	if (!session->written
+			|| scratchpad[DS18B2O_SCRATCHPAD_TH] != DS18B2O_MARKER
+			|| scratchpad[DS18B2O_SCRATCHPAD_TH + 1] != DS18B2O_MARKER
+			|| scratchpad[DS18B2O_SCRATCHPAD_CONFIG] != DS18B2O_CONFIG(session->written)) {
+		session->lost = 1;
+		*err = -EAGAIN;
+		CORO_EXIT(co);
+	}
 
 	//note: the 4 low bits in the low byte are fractional
-	*temp = low|(high<<8);
+	*temp = scratchpad[0] | (scratchpad[1]<<8);
 
-	return 0;
+	CORO_END(co);
 }
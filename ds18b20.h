@@ -1,7 +1,40 @@
 #include <stdint.h>
 #include "ds2483.h"
+#include "coro.h"
 #ifndef DS18B2O_H
 #define DS18B2O_H
-int8_t ds18b20_start_conversion(ds2483_dev_t *);
-int8_t ds18b20_read_temp(ds2483_dev_t *, int16_t*);
+
+/**
+ * Resolutions, in bits: each one more doubles the conversion time.
+ */
+#define DS18B20_MIN_BITS 9
+#define DS18B20_MAX_BITS 12
+
+/**
+ * Maximum conversion time at a resolution (tCONV), in microseconds.
+ */
+#define DS18B20_CONVERSION_US(bits) (750000UL >> (DS18B20_MAX_BITS - (bits)))
+
+/**
+ * State shared by the sensors of a bus: their configuration is written once
+ * and again only after one of them loses power.
+ */
+typedef struct {
+	//resolution to use, in bits
+	uint8_t bits;
+	//resolution last written to the devices, 0 if none
+	uint8_t written;
+	//set when a device was found to have lost its configuration
+	uint8_t lost;
+} ds18b20_session_t;
+
+/**
+ * Coroutines (see coro.h): co is owned by the caller and must not be shared
+ * with another operation in progress.
+ */
+int8_t ds18b20_find(coro_t *, ds2483_dev_t *, uint8_t (*)[ONEWIRE_ROM_SIZE], uint8_t, uint8_t *, int8_t *);
+int8_t ds18b20_start_conversion(coro_t *, ds2483_dev_t *, ds18b20_session_t *, int8_t *);
+int8_t ds18b20_poll_conversion(coro_t *, ds2483_dev_t *, uint8_t *, int8_t *);
+int8_t ds18b20_read_temp(coro_t *, ds2483_dev_t *, ds18b20_session_t *, const uint8_t *, uint8_t,
+		int16_t *, int8_t *);
 #endif
@@ -1,8 +1,11 @@
 #include <avr/io.h>
-#include <malloc.h>
+#include <util/delay.h>
+#include <stddef.h>
+#include <util/crc16.h>
 #include <twi_master.h>
 #include "config.h"
 #include "ds2483.h"
+#include "error.h"
 
 #define ATTR_ALWAYS_INLINE __attribute__ ((always_inline))
 
@@ -10,138 +13,412 @@
 	#define DS2483_1W_WAIT_TIMEOUT 10
 #endif
 
-static inline void ds2483_write_read(ds2483_dev_t * dev, uint8_t txbytes,
-		uint8_t * txbuf, uint8_t rxbytes, uint8_t * rxbuf) ATTR_ALWAYS_INLINE;
+/**
+ * Queue the first n segments of dev->seg as one I2C transaction and wait (in
+ * coroutine co) for it to complete.
+ */
+#define DS2483_SUBMIT(co, dev, n) do { \
+		(dev)->txn.nsegs = (n); \
+		(dev)->busy = 1; \
+		twi_master_submit((dev)->twim, &(dev)->txn); \
+		CORO_WAIT_UNTIL(co, !(dev)->busy); \
+	} while (0)
 
-static inline void ds2483_read(ds2483_dev_t * dev, uint8_t len, uint8_t * buf)
-	ATTR_ALWAYS_INLINE;
+/**
+ * Run a single segment I2C transaction and wait (in coroutine co) for it to
+ * complete.
+ */
+#define DS2483_TXN(co, dev, txbytes, txbuf, rxbytes, rxbuf) do { \
+		twi_segment_set(&(dev)->seg[0], DS2483_I2C_ADDR, txbytes, txbuf, rxbytes, rxbuf); \
+		DS2483_SUBMIT(co, dev, 1); \
+	} while (0)
 
-static inline void ds2483_write(ds2483_dev_t * dev, uint8_t len, uint8_t * buf)
-	ATTR_ALWAYS_INLINE;
+/**
+ * Sleep (in coroutine co) for ticks of the high resolution timer.
+ */
+#define DS2483_SLEEP(co, dev, ticks) do { \
+		(dev)->busy = 1; \
+		hrtimer_start(&(dev)->timer, ticks, ds2483_wakeup, dev); \
+		CORO_WAIT_UNTIL(co, !(dev)->busy); \
+	} while (0)
 
-static uint8_t ds2483_1w_wait_idle(ds2483_dev_t * dev);
+static void ds2483_txn_complete(void * ins, int8_t status);
+static void ds2483_wakeup(void * ins);
+static int8_t ds2483_1w_wait_idle(ds2483_dev_t * dev, hrtimer_ticks_t ticks);
+static int8_t ds2483_1w_bit_cmd(ds2483_dev_t * dev, uint8_t cmd, uint8_t bit, hrtimer_ticks_t ticks);
+static void ds2483_1w_script_repeat(ds2483_dev_t * dev, const uint8_t * script);
 
-ds2483_dev_t * ds2483_init(twi_master_t * twim, PORT_t * slpz_port, uint8_t slpz_pin) {
-	ds2483_dev_t * dev;
-	dev = smalloc(sizeof *dev);
+//set the read pointer to the read data register
+static uint8_t read_data_ptr[2] = { DS2483_CMD_SET_READ_PTR, DS2483_REGISTER_READ_DATA };
 
+/**
+ * Initialize dev, which the caller allocates (statically).
+ *
+ * @param notify called from the TWI interrupt whenever a transaction
+ * completes, so that the owner can resume its coroutine.
+ */
+void ds2483_init(ds2483_dev_t * dev, twi_master_t * twim, PORT_t * slpz_port, uint8_t slpz_pin,
+		void (*notify)(void)) {
 	dev->twim = twim;
 	dev->slpz_port = slpz_port;
 	dev->slpz_pin = slpz_pin;	
+	dev->notify = notify;
+	dev->busy = 0;
+	dev->timer.pending = 0;
+
+	dev->txn.segs = dev->seg;
+	dev->txn.nsegs = 1;
+	dev->txn.timeout = 0;
+	dev->txn.complete = ds2483_txn_complete;
+	dev->txn.ctx = dev;
+	dev->txn.status = TWI_MASTER_STATUS_OK;
 
+	//the device starts awake; see ds2483_sleep()/ds2483_wake()
 	dev->slpz_port->DIRSET = dev->slpz_pin;
-	//@TODO on/off
 	dev->slpz_port->OUTSET = dev->slpz_pin;
-
-	return dev;
-}
-
-static inline void ds2483_write(ds2483_dev_t * dev, uint8_t len, uint8_t * buf) {
-	twi_master_write(dev->twim, DS2483_I2C_ADDR, len, buf);
 }
 
-static inline void ds2483_read(ds2483_dev_t * dev, uint8_t len, uint8_t * buf) {
-	twi_master_read(dev->twim, DS2483_I2C_ADDR, len, buf);
-}
+static void ds2483_txn_complete(void * ins, int8_t status) {
+	ds2483_dev_t * dev = ins;
 
-static inline void ds2483_write_read(ds2483_dev_t * dev, uint8_t txbytes,
-		uint8_t * txbuf, uint8_t rxbytes, uint8_t * rxbuf) {
-	twi_master_write_read(dev->twim, DS2483_I2C_ADDR, txbytes, txbuf, rxbytes, rxbuf);
+	dev->twi_status = status;
+	dev->busy = 0;
+	dev->notify();
 }
 
-/**
- * Initiates reads on the one wire bus, and reads a single byte,
- * which is stored in the read data register. The read data register
- * is then fetched and returned to the caller.
- *
- * @return a byte read from the one wire bus
- */
-uint8_t ds2483_1w_read_byte(ds2483_dev_t * dev) {
-	dev->cmd[0] = DS2483_CMD_1W_READ_BYTE;
-	ds2483_write(dev, 1, dev->cmd);
-	ds2483_1w_wait_idle(dev);
-	return ds2483_read_register(dev, DS2483_REGISTER_READ_DATA);
-}
+static void ds2483_wakeup(void * ins) {
+	ds2483_dev_t * dev = ins;
 
-/*
- * Writes a byte to the one wire bus.
- */
-void ds2483_1w_write(ds2483_dev_t * dev, uint8_t data) {
-	dev->cmd[0] = DS2483_CMD_1W_WRITE_BYTE;
-	dev->cmd[1] = data;
-	ds2483_write(dev, 2, dev->cmd);
-	ds2483_1w_wait_idle(dev);
+	dev->busy = 0;
+	dev->notify();
 }
 
 /**
  * Sets the read pointer on the DS2483. Subsequent read attempts
  * to the device will read from the specified register.
  */
-void ds2483_set_read_ptr(ds2483_dev_t * dev, uint8_t reg) {
+int8_t ds2483_set_read_ptr(ds2483_dev_t * dev, uint8_t reg) {
+	CORO_BEGIN(&dev->op);
+
 	dev->cmd[0] = DS2483_CMD_SET_READ_PTR;
 	dev->cmd[1] = reg;
-	ds2483_write(dev, 2, dev->cmd);
+	DS2483_TXN(&dev->op, dev, 2, dev->cmd, 0, NULL);
+
+	CORO_END(&dev->op);
 }
 
 /**
  * Reads a single byte from the DS2483, read from the register
- * set by ds2483_set_read_ptr
- *
- * @return the byte read
+ * set by ds2483_set_read_ptr, into dev->result.
  */
-uint8_t ds2483_read_byte(ds2483_dev_t * dev) {
-	ds2483_read(dev, 1, (uint8_t*)&dev->result);
-	return dev->result;
+int8_t ds2483_read_byte(ds2483_dev_t * dev) {
+	CORO_BEGIN(&dev->op);
+
+	DS2483_TXN(&dev->op, dev, 0, NULL, 1, (uint8_t*)&dev->result);
+
+	CORO_END(&dev->op);
 }
 
 /**
  * Sets the read pointer and reads a single byte in one transaction.
- *
- * @return the value of the requested register
+ * The value of the requested register is stored in dev->result.
  */
-uint8_t ds2483_read_register(ds2483_dev_t * dev, uint8_t reg) {
+int8_t ds2483_read_register(ds2483_dev_t * dev, uint8_t reg) {
+	CORO_BEGIN(&dev->op);
+
 	dev->cmd[0] = DS2483_CMD_SET_READ_PTR;
 	dev->cmd[1] = reg;
-	ds2483_write_read(dev, 2, dev->cmd, 1, (uint8_t*)&dev->result);
-	return dev->result;
+	DS2483_TXN(&dev->op, dev, 2, dev->cmd, 1, (uint8_t*)&dev->result);
+
+	CORO_END(&dev->op);
 }
 
 /**
  * Resets the DS2483
  */
-void ds2483_rst(ds2483_dev_t * dev) {
+int8_t ds2483_rst(ds2483_dev_t * dev) {
+	CORO_BEGIN(&dev->op);
+
 	dev->cmd[0] = DS2483_CMD_RST;
-	ds2483_write(dev,1,&dev->cmd[0]);
+	DS2483_TXN(&dev->op, dev, 1, dev->cmd, 0, NULL);
+
+	CORO_END(&dev->op);
+}
+
+/**
+ * Put the DS2483 into sleep mode by pulling SLPZ low. The 1-Wire bus must be
+ * idle. The device configuration is retained while asleep.
+ */
+void ds2483_sleep(ds2483_dev_t * dev) {
+	dev->slpz_port->OUTCLR = dev->slpz_pin;
+}
+
+/**
+ * Wake the DS2483 and wait for its oscillator to start.
+ */
+void ds2483_wake(ds2483_dev_t * dev) {
+	dev->slpz_port->OUTSET = dev->slpz_pin;
+	_delay_us(DS2483_WAKEUP_US);
+}
+
+/**
+ * Run a 1-Wire script: a sequence of DS2483_OP_* opcodes (DS2483_OP_WRITE
+ * followed by its byte, DS2483_OP_WRITE_IN and DS2483_OP_READ_N by a count)
+ * ending with DS2483_OP_END. Bytes written by DS2483_OP_WRITE_IN are taken
+ * from in, and bytes read are stored in out, in order. dev->error is set to 0, or to a negative error code if the
+ * script stopped early.
+ *
+ * Each 1-Wire command is sent in one I2C write. The DS2483 then points its
+ * read pointer at the status register, so completion is polled with bare
+ * one byte reads, starting once the operation has had time to finish. A byte
+ * read from the bus is fetched from the read data register in the same
+ * transaction as the next command.
+ */
+int8_t ds2483_1w_script(ds2483_dev_t * dev, const uint8_t * script,
+		const uint8_t * in, uint8_t * out) {
+	CORO_BEGIN(&dev->op);
+
+	dev->error = 0;
+	dev->pc = 0;
+	dev->nout = 0;
+	dev->nin = 0;
+	dev->repeat = 0;
+	dev->fetch = 0;
+
+	while ((dev->opcode = script[dev->pc++]) != DS2483_OP_END) {
+		if (dev->opcode == DS2483_OP_RESET) {
+			dev->cmd[0] = DS2483_CMD_BUS_RST;
+			dev->ticks = HRTIMER_US(DS2483_1W_RST_US);
+		} else if (dev->opcode == DS2483_OP_WRITE) {
+			dev->cmd[0] = DS2483_CMD_1W_WRITE_BYTE;
+			dev->cmd[1] = script[dev->pc++];
+			dev->ticks = HRTIMER_US(DS2483_1W_BYTE_US);
+		} else if (dev->opcode == DS2483_OP_WRITE_IN) {
+			dev->opcode = DS2483_OP_WRITE;
+			dev->cmd[0] = DS2483_CMD_1W_WRITE_BYTE;
+			dev->cmd[1] = in[dev->nin++];
+			dev->ticks = HRTIMER_US(DS2483_1W_BYTE_US);
+			ds2483_1w_script_repeat(dev, script);
+		} else if (dev->opcode == DS2483_OP_READ || dev->opcode == DS2483_OP_READ_N) {
+			if (dev->opcode == DS2483_OP_READ_N) {
+				dev->opcode = DS2483_OP_READ;
+				ds2483_1w_script_repeat(dev, script);
+			}
+			dev->cmd[0] = DS2483_CMD_1W_READ_BYTE;
+			dev->ticks = HRTIMER_US(DS2483_1W_BYTE_US);
+		} else {
+			dev->error = -EINVAL;
+			CORO_EXIT(&dev->op);
+		}
+
+		if (dev->fetch) {
+			twi_segment_set(&dev->seg[0], DS2483_I2C_ADDR, 2, read_data_ptr, 1, &out[dev->nout++]);
+			twi_segment_set(&dev->seg[1], DS2483_I2C_ADDR,
+					dev->opcode == DS2483_OP_WRITE ? 2 : 1, dev->cmd, 0, NULL);
+			dev->fetch = 0;
+			DS2483_SUBMIT(&dev->op, dev, 2);
+		} else {
+			DS2483_TXN(&dev->op, dev, dev->opcode == DS2483_OP_WRITE ? 2 : 1, dev->cmd, 0, NULL);
+		}
+
+		if (dev->twi_status) {
+			dev->error = -EIO;
+			CORO_EXIT(&dev->op);
+		}
+
+		CORO_SPAWN(&dev->op, &dev->wait, ds2483_1w_wait_idle(dev, dev->ticks));
+		if (dev->error)
+			CORO_EXIT(&dev->op);
+
+		if (dev->opcode == DS2483_OP_RESET && !(dev->result & DS2483_STATUS_PPD)) {
+			dev->error = -ENODEV;
+			CORO_EXIT(&dev->op);
+		}
+
+		dev->fetch = dev->opcode == DS2483_OP_READ;
+	}
+
+	if (dev->fetch) {
+		DS2483_TXN(&dev->op, dev, 2, read_data_ptr, 1, &out[dev->nout++]);
+		if (dev->twi_status)
+			dev->error = -EIO;
+	}
+
+	CORO_END(&dev->op);
+}
+
+/**
+ * Make ds2483_1w_script() run the counted opcode just fetched again, until it
+ * has run as many times as the count that follows it.
+ */
+static void ds2483_1w_script_repeat(ds2483_dev_t * dev, const uint8_t * script) {
+	if (++dev->repeat < script[dev->pc]) {
+		dev->pc--;
+	} else {
+		dev->repeat = 0;
+		dev->pc++;
+	}
+}
+
+/**
+ * 1-Wire triplet: read a bit and its complement, then write dir, or the bit
+ * read if only one value was seen. The status register, left in dev->result,
+ * holds the bits read (SBR, TSB) and the one written (DIR).
+ */
+int8_t ds2483_1w_triplet(ds2483_dev_t * dev, uint8_t dir) {
+	return ds2483_1w_bit_cmd(dev, DS2483_CMD_1W_TRIPLET, dir,
+			HRTIMER_US(3*DS2483_1W_SLOT_US));
+}
+
+/**
+ * A single 1-Wire time slot: write bit, or read one if bit is 1. The bit read
+ * is DS2483_STATUS_SBR of the status register, left in dev->result.
+ */
+int8_t ds2483_1w_bit(ds2483_dev_t * dev, uint8_t bit) {
+	return ds2483_1w_bit_cmd(dev, DS2483_CMD_1W_SINGLE_BIT, bit,
+			HRTIMER_US(DS2483_1W_SLOT_US));
 }
 
 /**
- * Performs a reset/presence detect
+ * Send a 1-Wire bit command, whose parameter is bit in bit 7, and wait ticks
+ * for its time slots before polling for completion.
+ */
+static int8_t ds2483_1w_bit_cmd(ds2483_dev_t * dev, uint8_t cmd, uint8_t bit, hrtimer_ticks_t ticks) {
+	CORO_BEGIN(&dev->op);
+
+	dev->error = 0;
+	dev->cmd[0] = cmd;
+	dev->cmd[1] = bit ? 0x80 : 0;
+	DS2483_TXN(&dev->op, dev, 2, dev->cmd, 0, NULL);
+	if (dev->twi_status) {
+		dev->error = -EIO;
+		CORO_EXIT(&dev->op);
+	}
+
+	CORO_SPAWN(&dev->op, &dev->wait, ds2483_1w_wait_idle(dev, ticks));
+
+	CORO_END(&dev->op);
+}
+
+/**
+ * Direction of the search at dev->search_bit: the branch of the previous pass
+ * before its last discrepancy, 1 at it, 0 past it.
+ */
+static uint8_t ds2483_1w_search_dir(ds2483_dev_t * dev, const uint8_t * rom) {
+	uint8_t bit = dev->search_bit - 1;
+
+	if (dev->search_bit < dev->last_discrepancy)
+		return rom[bit >> 3] & (1 << (bit & 7));
+	return dev->search_bit == dev->last_discrepancy;
+}
+
+void ds2483_1w_search_reset(ds2483_dev_t * dev) {
+	dev->last_discrepancy = 0;
+	dev->last_device = 0;
+}
+
+/**
+ * Find the next device on the bus (Maxim AN187), one triplet per ROM bit.
+ * At each bit where devices disagree, the previous pass took 1 at its last
+ * discrepancy and 0 past it; this pass takes the other branch there.
  *
- * @return 1 if device present, 0 otherwise
+ * @param rom the ROM found by the previous pass; replaced by the next one.
+ * dev->error is set to 0 if a device was found, -ENODEV if there are no
+ * more, -EINVAL if the ROM read is corrupt, -EIO if an I2C transaction
+ * failed or -ETIMEDOUT if the DS2483 stayed busy.
  */
-uint8_t ds2483_1w_rst(ds2483_dev_t * dev) {
-	dev->cmd[0] = DS2483_CMD_BUS_RST;
-	ds2483_write(dev, 1, &dev->cmd[0]);
-	return (ds2483_1w_wait_idle(dev) & DS2483_STATUS_PPD) ? 1 : 0;
+int8_t ds2483_1w_search(coro_t * co, ds2483_dev_t * dev, uint8_t * rom) {
+	static const uint8_t search_script[] = {
+		DS2483_OP_RESET,
+		DS2483_OP_WRITE, ONEWIRE_CMD_SEARCH_ROM,
+		DS2483_OP_END
+	};
+	uint8_t bit, crc;
+
+	CORO_BEGIN(co);
+
+	if (dev->last_device) {
+		dev->error = -ENODEV;
+		CORO_EXIT(co);
+	}
+
+	CORO_SPAWN(co, &dev->op, ds2483_1w_script(dev, search_script, NULL, NULL));
+	if (dev->error) {
+		ds2483_1w_search_reset(dev);
+		CORO_EXIT(co);
+	}
+
+	dev->last_zero = 0;
+	for (dev->search_bit = 1; dev->search_bit <= 64; ++dev->search_bit) {
+		CORO_SPAWN(co, &dev->op, ds2483_1w_triplet(dev, ds2483_1w_search_dir(dev, rom)));
+		if (dev->error) {
+			ds2483_1w_search_reset(dev);
+			CORO_EXIT(co);
+		}
+		bit = dev->search_bit - 1;
+
+		if ((dev->result & DS2483_STATUS_SBR) && (dev->result & DS2483_STATUS_TSB)) {
+			//no device answered
+			dev->error = -ENODEV;
+			ds2483_1w_search_reset(dev);
+			CORO_EXIT(co);
+		}
+
+		if (!(dev->result & (DS2483_STATUS_SBR | DS2483_STATUS_TSB | DS2483_STATUS_DIR)))
+			dev->last_zero = dev->search_bit;
+
+		if (dev->result & DS2483_STATUS_DIR)
+			rom[bit >> 3] |= 1 << (bit & 7);
+		else
+			rom[bit >> 3] &= ~(1 << (bit & 7));
+	}
+
+	dev->last_discrepancy = dev->last_zero;
+	dev->last_device = dev->last_discrepancy == 0;
+
+	crc = 0;
+	for (uint8_t i = 0; i < ONEWIRE_ROM_SIZE; ++i)
+		crc = _crc_ibutton_update(crc, rom[i]);
+	dev->error = crc ? -EINVAL : 0;
+
+	CORO_END(co);
 }
 
 /**
- * Waits for any ongoing one wire bus activity to finish.
+ * Waits for any ongoing one wire bus activity to finish: sleeps for the
+ * expected duration of the operation, then polls the status register, one
+ * time slot apart, until the bus is idle. The read pointer must be on the
+ * status register, as it is after any 1-Wire command.
+ *
+ * Polling at once used to exhaust DS2483_1W_WAIT_TIMEOUT reads before a reset
+ * could finish, which is why bare reads seemed not to work.
  *
- * @return The contents of the status register
- */
-static uint8_t ds2483_1w_wait_idle(ds2483_dev_t * dev) {
-	uint8_t tries = 0;
-
-	uint8_t result = ds2483_read_register(dev, DS2483_REGISTER_STATUS);
-	while (tries++ < DS2483_1W_WAIT_TIMEOUT && (result & DS2483_STATUS_1WB)) {
-		/**
-		 * @TODO I should just be able to ds2483_read_byte(dev) here...
-		 * For some reason that isn't working. Seems like timing: adding a 1ms
-		 * delay in DOES work. WHY WHY WHY???
-		 */
-		result = ds2483_read_register(dev, DS2483_REGISTER_STATUS);
+ * The contents of the status register are left in dev->result; dev->error is
+ * set if the bus stays busy or the DS2483 does not answer.
+ */
+static int8_t ds2483_1w_wait_idle(ds2483_dev_t * dev, hrtimer_ticks_t ticks) {
+	CORO_BEGIN(&dev->wait);
+
+	DS2483_SLEEP(&dev->wait, dev, ticks);
+
+	dev->tries = 0;
+	while (1) {
+		DS2483_TXN(&dev->wait, dev, 0, NULL, 1, (uint8_t*)&dev->result);
+		if (dev->twi_status) {
+			dev->error = -EIO;
+			break;
+		}
+
+		if (!(dev->result & DS2483_STATUS_1WB))
+			break;
+
+		if (dev->tries++ >= DS2483_1W_WAIT_TIMEOUT) {
+			dev->error = -ETIMEDOUT;
+			break;
+		}
+
+		DS2483_SLEEP(&dev->wait, dev, HRTIMER_US(DS2483_1W_SLOT_US));
 	}
 
-	return result;
+	CORO_END(&dev->wait);
 }
@@ -1,4 +1,6 @@
 #include <twi_master.h>
+#include "coro.h"
+#include "hrtimer.h"
 
 #ifndef DS2483_H
 #define DS2483_H
@@ -16,6 +18,8 @@
 #define DS2483_CMD_SET_READ_PTR 0xE1
 #define DS2483_CMD_1W_WRITE_BYTE 0xA5
 #define DS2483_CMD_1W_READ_BYTE 0x96
+#define DS2483_CMD_1W_TRIPLET 0x78
+#define DS2483_CMD_1W_SINGLE_BIT 0x87
 
 #define DS2483_REGISTER_STATUS 0xF0
 #define DS2483_REGISTER_READ_DATA 0xE1
@@ -24,9 +28,48 @@
 
 #define DS2483_STATUS_1WB 0x01
 #define DS2483_STATUS_PPD 0x02
+#define DS2483_STATUS_SBR 0x20
+#define DS2483_STATUS_TSB 0x40
+#define DS2483_STATUS_DIR 0x80
 
 #define DS2483_I2C_ADDR 0x18
 
+/**
+ * Oscillator wakeup time after SLPZ goes high (tOSCWUP), in microseconds.
+ */
+#define DS2483_WAKEUP_US 100
+
+/**
+ * Duration of 1-Wire operations at standard speed, in microseconds: the
+ * bus is not polled for completion before they have had time to finish.
+ * A reset is tRSTL + tRSTH, a byte is 8 time slots.
+ */
+#define DS2483_1W_RST_US 1148
+#define DS2483_1W_SLOT_US 70
+#define DS2483_1W_BYTE_US (8*DS2483_1W_SLOT_US)
+
+/**
+ * Opcodes of a 1-Wire script (see ds2483_1w_script()).
+ */
+//end of the script
+#define DS2483_OP_END 0
+//reset/presence detect: the script fails with -ENODEV if nothing answers
+#define DS2483_OP_RESET 1
+//write the byte that follows the opcode
+#define DS2483_OP_WRITE 2
+//read a byte into the next position of the output buffer
+#define DS2483_OP_READ 3
+//write the number of bytes that follows the opcode, from the input buffer
+#define DS2483_OP_WRITE_IN 4
+//read the number of bytes that follows the opcode
+#define DS2483_OP_READ_N 5
+
+//1-Wire ROM commands
+#define ONEWIRE_CMD_SEARCH_ROM 0xF0
+#define ONEWIRE_CMD_MATCH_ROM 0x55
+#define ONEWIRE_CMD_SKIP_ROM 0xCC
+#define ONEWIRE_ROM_SIZE 8
+
 struct ds2483_dev_struct;
 typedef struct ds2483_dev_struct {
 	twi_master_t * twim;
@@ -34,18 +77,72 @@ typedef struct ds2483_dev_struct {
 	uint8_t slpz_pin;
 	uint8_t cmd[2];
 	volatile uint8_t result;
+	//0 or a negative error code (error.h), set by ds2483_1w_script(): a
+	//failed I2C transaction is -EIO
+	int8_t error;
+
+	//the I2C transaction of the current step
+	twi_txn_t txn;
+	twi_segment_t seg[2];
+
+	//called (from the TWI interrupt) when a transaction completes
+	void (*notify)(void);
+	volatile uint8_t busy;
+	//TWI_MASTER_STATUS_* of the last transaction: not an error.h code
+	volatile int8_t twi_status;
+
+	//coroutine state of the current operation and of its wait for 1WB
+	coro_t op;
+	coro_t wait;
+	uint8_t tries;
+	hrtimer_t timer;
+
+	//state of ds2483_1w_script(): next opcode, opcode running, bytes read
+	//and written, a read byte still to fetch, expected duration of the
+	//operation
+	uint8_t pc;
+	uint8_t opcode;
+	uint8_t nout;
+	uint8_t nin;
+	uint8_t repeat;
+	uint8_t fetch;
+	hrtimer_ticks_t ticks;
+
+	//state of ds2483_1w_search(): bit position in the ROM (1-64), last
+	//discrepancy of the previous pass and of this one, no more devices
+	uint8_t search_bit;
+	uint8_t last_discrepancy;
+	uint8_t last_zero;
+	uint8_t last_device;
 } ds2483_dev_t;
 
 
-ds2483_dev_t * ds2483_init(twi_master_t * twim, PORT_t * splz_port, uint8_t splz_pin);
+void ds2483_init(ds2483_dev_t * dev, twi_master_t * twim, PORT_t * splz_port, uint8_t splz_pin,
+		void (*notify)(void));
+
+/**
+ * The following are coroutines (see coro.h) sharing dev->op: run them with
+ * CORO_SPAWN(co, &dev->op, ds2483_...(dev, ...)), one at a time. Values read
+ * are left in dev->result.
+ */
+int8_t ds2483_rst(ds2483_dev_t * dev);
+int8_t ds2483_read_register(ds2483_dev_t * dev, uint8_t reg);
+int8_t ds2483_read_byte(ds2483_dev_t * dev);
+int8_t ds2483_set_read_ptr(ds2483_dev_t * dev, uint8_t reg);
+int8_t ds2483_1w_script(ds2483_dev_t * dev, const uint8_t * script,
+		const uint8_t * in, uint8_t * out);
+int8_t ds2483_1w_triplet(ds2483_dev_t * dev, uint8_t dir);
+int8_t ds2483_1w_bit(ds2483_dev_t * dev, uint8_t bit);
+
+/**
+ * ROM search: a coroutine run with its own co, which uses dev->op. Call
+ * ds2483_1w_search_reset() first, then ds2483_1w_search() once per device.
+ */
+void ds2483_1w_search_reset(ds2483_dev_t * dev);
+int8_t ds2483_1w_search(coro_t * co, ds2483_dev_t * dev, uint8_t * rom);
 
-uint8_t ds2483_1w_rst(ds2483_dev_t * dev);
-void ds2483_rst(ds2483_dev_t * dev);
-uint8_t ds2483_read_register(ds2483_dev_t * dev, uint8_t reg);
-uint8_t ds2483_read_byte(ds2483_dev_t * dev);
-void ds2483_set_read_ptr(ds2483_dev_t * dev, uint8_t reg);
-uint8_t ds2483_1w_read_byte(ds2483_dev_t * dev);
-void ds2483_1w_write(ds2483_dev_t * dev, uint8_t data);
+void ds2483_sleep(ds2483_dev_t * dev);
+void ds2483_wake(ds2483_dev_t * dev);
 #define DS2483_INTERRUPT_HANDLER(ISR, dev) ISR { twi_master_isr(dev->twim); }
 
 #endif
@@ -4,5 +4,8 @@
 #define ENODEV 1
 #define ENOMEM 2
 #define EINVAL 3
+#define ETIMEDOUT 4
+#define EAGAIN 5
+#define EIO 6
 
 #endif
@@ -0,0 +1,148 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include <stddef.h>
+#include "hrtimer.h"
+#include "error.h"
+#include "config.h"
+
+/**
+ * Pending timers are kept in a list sorted by expiry, which is short: each
+ * driver has at most one wait in progress. Expiries are compared relative to
+ * the counter, which is valid since none is more than HRTIMER_MAX_TICKS away.
+ * The compare channel A interrupt is set to the first one and is disabled
+ * when the list is empty. Callbacks run in that interrupt, at
+ * HRTIMER_INTLVL, and may start timers again.
+ */
+static hrtimer_t * head;
+
+static void hrtimer_program(void);
+
+/**
+ * Start the counter: run at boot.
+ */
+void hrtimer_init(void) {
+	HRTIMER_TC.CTRLA = TC_CLKSEL_OFF_gc;
+	HRTIMER_TC.CTRLB = TC_WGMODE_NORMAL_gc;
+	HRTIMER_TC.CNT = 0;
+	HRTIMER_TC.PER = 0xFFFF;
+	HRTIMER_TC.INTCTRLB &= ~TC_CCAINTLVL_gm;
+	HRTIMER_TC.CTRLA = TC_CLKSEL_DIV8_gc;
+
+	head = NULL;
+}
+
+/**
+ * @return the counter, in HRTIMER_HZ ticks. Wraps every 16ms: only
+ * differences are meaningful.
+ */
+uint16_t hrtimer_now(void) {
+	uint16_t cnt;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		cnt = HRTIMER_TC.CNT;
+	}
+
+	return cnt;
+}
+
+/**
+ * Call cb(ctx) from the timer interrupt in ticks (see HRTIMER_US()). A timer
+ * that is pending is started again with the new delay.
+ *
+ * @return 0, or -EINVAL if ticks is above HRTIMER_MAX_TICKS
+ */
+int8_t hrtimer_start(hrtimer_t * t, hrtimer_ticks_t ticks, void (*cb)(void *), void * ctx) {
+	hrtimer_t ** pos;
+
+	if (ticks > HRTIMER_MAX_TICKS)
+		return -EINVAL;
+	if (ticks < HRTIMER_MIN_TICKS)
+		ticks = HRTIMER_MIN_TICKS;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (t->pending)
+			hrtimer_cancel(t);
+
+		t->cb = cb;
+		t->ctx = ctx;
+		t->expires = HRTIMER_TC.CNT + ticks;
+		t->pending = 1;
+
+		uint16_t now = HRTIMER_TC.CNT;
+		for (pos = &head; *pos && (int16_t)((*pos)->expires - now) <= (int16_t)(t->expires - now);
+				pos = &(*pos)->next);
+		t->next = *pos;
+		*pos = t;
+
+		if (head == t)
+			hrtimer_program();
+	}
+
+	return 0;
+}
+
+/**
+ * Stop a pending timer. Safe from the callbacks of other timers.
+ *
+ * @return 0, or -EINVAL if the timer was not pending
+ */
+int8_t hrtimer_cancel(hrtimer_t * t) {
+	hrtimer_t ** pos;
+	int8_t rc = -EINVAL;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		for (pos = &head; *pos; pos = &(*pos)->next) {
+			if (*pos == t) {
+				*pos = t->next;
+				t->pending = 0;
+				rc = 0;
+				break;
+			}
+		}
+
+		if (rc == 0 && pos == &head)
+			hrtimer_program();
+	}
+
+	return rc;
+}
+
+/**
+ * Set the compare value to the first expiry. If the counter has already
+ * reached it, the match may have been missed: the compare is moved to
+ * HRTIMER_MIN_TICKS from now and the timer runs late. Interrupts must be
+ * disabled.
+ */
+static void hrtimer_program(void) {
+	if (!head) {
+		HRTIMER_TC.INTCTRLB &= ~TC_CCAINTLVL_gm;
+		return;
+	}
+
+	HRTIMER_TC.CCA = head->expires;
+	//matches while the interrupt was disabled leave the flag set
+	HRTIMER_TC.INTFLAGS = TC0_CCAIF_bm;
+	if ((int16_t)(head->expires - HRTIMER_TC.CNT) <= 0)
+		HRTIMER_TC.CCA = HRTIMER_TC.CNT + HRTIMER_MIN_TICKS;
+
+	HRTIMER_TC.INTCTRLB = (HRTIMER_TC.INTCTRLB & ~TC_CCAINTLVL_gm) | HRTIMER_INTLVL;
+}
+
+/**
+ * Run every timer that has expired, then set the compare to the next one.
+ * A timer is unlinked before its callback runs, so that the callback can
+ * start it again.
+ */
+ISR(HRTIMER_vect) {
+	hrtimer_t * t;
+
+	while (head && (int16_t)(head->expires - HRTIMER_TC.CNT) <= 0) {
+		t = head;
+		head = t->next;
+		t->pending = 0;
+		t->cb(t->ctx);
+	}
+
+	hrtimer_program();
+}
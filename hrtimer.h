@@ -0,0 +1,51 @@
+#include <stdint.h>
+#include "timer.h"
+
+#ifndef HRTIMER_H
+#define HRTIMER_H
+
+/**
+ * One-shot timers with sub-microsecond resolution for short waits and
+ * timeouts, on HRTIMER_TC running freely at F_CPU/HRTIMER_DIV: 4 ticks per
+ * microsecond at 32MHz. A timer can be at most HRTIMER_MAX_TICKS (~8ms)
+ * away; longer waits belong on the RTC timers of timer.h.
+ */
+#define HRTIMER_DIV 8
+#define HRTIMER_HZ (F_CPU/HRTIMER_DIV)
+#define HRTIMER_MAX_TICKS 0x7FFF
+
+/**
+ * Shorter delays are rounded up, so that the compare value is not missed.
+ */
+#define HRTIMER_MIN_TICKS 16
+
+/**
+ * Ticks for a delay of at least us microseconds. us must be a constant: a
+ * delay above HRTIMER_MAX_TICKS fails to compile.
+ */
+#define HRTIMER_US(us) ((uint16_t)TIMER_CHECKED( \
+		((us)*(uint64_t)HRTIMER_HZ + 999999)/1000000 <= HRTIMER_MAX_TICKS, \
+		((us)*(uint64_t)HRTIMER_HZ + 999999)/1000000))
+
+typedef uint16_t hrtimer_ticks_t;
+
+/**
+ * A timer is owned by its user, usually embedded in a driver's state, and
+ * must not be reused while it is pending.
+ */
+struct hrtimer_struct;
+typedef struct hrtimer_struct {
+	struct hrtimer_struct * next;
+	//HRTIMER_TC.CNT at expiry
+	uint16_t expires;
+	void (*cb)(void *);
+	void * ctx;
+	uint8_t pending;
+} hrtimer_t;
+
+void hrtimer_init(void);
+int8_t hrtimer_start(hrtimer_t * t, hrtimer_ticks_t ticks, void (*cb)(void *), void * ctx);
+int8_t hrtimer_cancel(hrtimer_t * t);
+uint16_t hrtimer_now(void);
+
+#endif
@@ -0,0 +1,73 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+
+#include "idle.h"
+#include "tasks.h"
+#include "stopwatch.h"
+#include "debug.h"
+#include "config.h"
+
+#define IDLE_REPORT_TAG 'I'
+
+static struct {
+	//start of the current accounting window
+	uint32_t window;
+	//stopwatch ticks spent asleep in the current window
+	uint32_t asleep;
+} idle_stats;
+
+void idle_init(void) {
+	set_sleep_mode(CONFIG_IDLE_SLEEP_MODE);
+	idle_stats.window = stopwatch_now();
+	idle_stats.asleep = 0;
+}
+
+/**
+ * Sleep until the next interrupt if there is no pending work. Tasks are
+ * only ever queued by interrupts or by other tasks, so checking the run
+ * queue with interrupts disabled and then executing sei; sleep (the
+ * instruction following sei always executes before any interrupt) cannot
+ * miss a wakeup.
+ */
+void idle(void) {
+	uint32_t start;
+
+	cli();
+	if (tasks_pending()) {
+		sei();
+		return;
+	}
+
+	start = stopwatch_now();
+	sleep_enable();
+	sei();
+	sleep_cpu();
+	sleep_disable();
+
+	idle_stats.asleep += stopwatch_now() - start;
+}
+
+/**
+ * @return the percentage of time spent asleep since the last call.
+ */
+uint8_t idle_sleep_percent(void) {
+	uint32_t now = stopwatch_now();
+	//+1 avoids division by zero; the error is well below 1%
+	uint32_t percent = idle_stats.asleep/((now - idle_stats.window)/100 + 1);
+
+	idle_stats.window = now;
+	idle_stats.asleep = 0;
+
+	return (percent > 100) ? 100 : percent;
+}
+
+/**
+ * Write the sleep percentage to the debug port.
+ */
+void idle_report(void) {
+	uint8_t report[2] = { IDLE_REPORT_TAG, idle_sleep_percent() };
+	DEBUG_CHECK_LEN(report);
+	debug_write(report, sizeof(report));
+}
@@ -0,0 +1,10 @@
+#include <stdint.h>
+#ifndef IDLE_H
+#define IDLE_H
+
+void idle_init(void);
+void idle(void);
+uint8_t idle_sleep_percent(void);
+void idle_report(void);
+
+#endif
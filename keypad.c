@@ -3,6 +3,10 @@
 #include "keypad.h"
 #include "timer.h"
 #include "tasks.h"
+#include "queue.h"
+
+//number of keypresses buffered for keypad_getc() (power of two)
+#define KEYPAD_QUEUE_SIZE 4
 
 /**
  * 3x4 matrix keypad driver.
@@ -24,13 +28,19 @@
 
 static void keypad_init_rowscan(void);
 static void keypad_init_colscan(void);
-static void keypad_scan_timer(void);
 static void keypad_scan(void);
 static void keypad_scan_end(void);
 
-volatile uint8_t keymask = 0;
+/**
+ * Keymasks of pressed keys. Produced by keypad_scan(), consumed by
+ * keypad_getc().
+ */
+QUEUE_DEFINE(key_queue, uint8_t, KEYPAD_QUEUE_SIZE, keys);
 static void (*keyhandler)(void);
 
+//samples the keypad every KEYPAD_SCAN_DELAY while a scan is in progress
+static timer_id_t scan_timer;
+
 typedef struct {
 	uint8_t colmask;
 	uint8_t rowmask;
@@ -116,23 +126,19 @@ static void keypad_scan_end(void) {
  *
  * When a pin change is detected by hardware, the KEYPAD_ISR interrupt
  * triggers. The interrupt initializes the keypad_scanner state machine and
- * schedules keypad_scan to run 2*KEYPAD_SCAN_SAMPLES times at
- * KEYPAD_SCAN_DELAY intervals.
+ * arms a periodic timer that schedules keypad_scan every KEYPAD_SCAN_DELAY,
+ * up to 2*KEYPAD_SCAN_SAMPLES times, until the scan ends.
  *
  * Half of the KEYPAD_SCAN_SAMPLES try to read the column while the other half
  * try to read the row. The columns are read first. When a column is
  * successfully read, the rows are configured for reading. If, after
  * KEYPAD_SCAN_SAMPLES attempts, no column is read, key scanning is aborted.
- * When a row is successfully read, the keymask of the pressed key is stored in
- * the keymask variable and the KEYPAD_REPEAT_RATE timer is activated. If no
+ * When a row is successfully read, the keymask of the pressed key is queued for
+ * keypad_getc() and the KEYPAD_REPEAT_RATE timer is activated. If no
  * row is read, scanning is aborted.
  * 
  * TL;DR: read the col, read the row, set the result, turn it all off for a bit.
  */
-static void keypad_scan_timer() {
-	task_schedule(keypad_scan);
-}
-
 static void keypad_scan(void) {
 	if (keypad_scanner.state == KEYPAD_STATE_COLSCAN) {
 		//cols are already setup to scan.
@@ -142,6 +148,9 @@ static void keypad_scan(void) {
 		if (keypad_scanner.colmask != 0 || keypad_scanner.samples == KEYPAD_SCAN_SAMPLES-1) {
 			//col was not read - abort
 			if (keypad_scanner.colmask == 0) {
+				keypad_scanner.state = KEYPAD_STATE_IDLE;
+				cancel_timer(scan_timer);
+				scan_timer = 0;
 				keypad_scan_end();
 
 			//col was read - try rows
@@ -149,10 +158,7 @@ static void keypad_scan(void) {
 				keypad_scanner.samples = 0;
 				keypad_scanner.state = KEYPAD_STATE_ROWSCAN;
 				keypad_init_rowscan();
-				add_timer(keypad_scan_timer, KEYPAD_SCAN_DELAY, 1);
 			}
-		} else {
-			add_timer(keypad_scan_timer, KEYPAD_SCAN_DELAY, 1);
 		}
 
 	} else if (keypad_scanner.state == KEYPAD_STATE_ROWSCAN) {
@@ -160,17 +166,19 @@ static void keypad_scan(void) {
 
 		if (keypad_scanner.rowmask != 0 || keypad_scanner.samples == KEYPAD_SCAN_SAMPLES-1) {
 			keypad_scanner.state = KEYPAD_STATE_IDLE;
+			cancel_timer(scan_timer);
+			scan_timer = 0;
+
 			if (keypad_scanner.rowmask == 0) {
 				keypad_scan_end();
 			} else {
-				keymask = keypad_scanner.colmask | keypad_scanner.rowmask;
+				key_queue_offer(&keys, keypad_scanner.colmask | keypad_scanner.rowmask);
 				if (keyhandler)
-					task_schedule(keyhandler);
+					task_schedule_prio(keyhandler, TASK_PRIO_LOW);
 
-				add_timer(keypad_scan_end, KEYPAD_REPEAT_RATE, 1);
+				if (add_deferred_timer(keypad_scan_end, KEYPAD_REPEAT_RATE, 1, TASK_PRIO_LOW) < 0)
+					keypad_scan_end();
 			}
-		} else {
-			add_timer(keypad_scan_timer, KEYPAD_SCAN_DELAY, 1);
 		}
 	}
 
@@ -186,15 +194,18 @@ KEYPAD_ISR {
 	keypad_scanner.state = KEYPAD_STATE_COLSCAN;
 	keypad_scanner.samples = 0;
 	keypad_int_disable();
-	add_timer(keypad_scan_timer, KEYPAD_SCAN_DELAY, 1);
+	scan_timer = add_deferred_timer(keypad_scan, KEYPAD_SCAN_DELAY, TIMER_RUN_UNLIMITED, TASK_PRIO_LOW | TASK_COALESCE);
+
+	//no timer available: wait for the next pin change
+	if (scan_timer < 0)
+		keypad_scan_end();
 }
 
 char keypad_getc(void) {
 	uint8_t tmp;
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		tmp = keymask;
-		keymask = 0;
-	}
+
+	if (!key_queue_poll(&keys, &tmp))
+		return '\0';
 
 	switch (tmp) {
 		case KEY_1:
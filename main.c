@@ -2,22 +2,33 @@
 #include <avr/io.h>
 #include "ssr.h"
 #include "timer.h"
+#include "hrtimer.h"
 #include "threads.h"
-#include "temp.h"
 #include "tasks.h"
 #include "yogurt.h"
+#include "stopwatch.h"
+#include "idle.h"
+#include "debug.h"
+#include "temp.h"
+#include "config.h"
 
 #define CLKSYS_Enable( _oscSel ) ( OSC.CTRL |= (_oscSel) )
 #define CLKSYS_IsReady( _oscSel ) ( OSC.STATUS & (_oscSel) )
 static void sysclk_set_internal_32mhz(void);
 static void main_thread(void);
+static void report(void);
 
 int main(void) {
 	sysclk_set_internal_32mhz();
 
 	tasks_init();
+	stopwatch_init();
 	init_timers();
+	hrtimer_init();
+	idle_init();
 	yogurt_init();
+	timer_set_slack(add_deferred_timer(report, DEBUG_REPORT_SECONDS*TIMER_HZ,
+				TIMER_RUN_UNLIMITED, TASK_PRIO_LOW | TASK_COALESCE), TIMER_SLACK_SECOND);
 
 	PMIC.CTRL |= PMIC_MEDLVLEN_bm | PMIC_LOLVLEN_bm | PMIC_HILVLEN_bm;
 	//interrupts will get enabled when process starts
@@ -25,14 +36,35 @@ int main(void) {
 
 	threads_init_stack();
 	thread_create("main",main_thread);
-	thread_create("temp",temp_run);
+#if TEMP_THREAD
+	thread_create("temp",temp_thread);
+#endif
+#if THREADS_PREEMPT_TEST
+	threads_preempt_test_init();
+#endif
 	threads_start_main();
 	return 0;
 }
 
 static void main_thread(void) {
-	while (1)
-		tasks_run();
+	while (1) {
+		if (!tasks_run())
+			idle();
+	}
+}
+
+/**
+ * Periodic statistics written to the debug port.
+ */
+static void report(void) {
+	idle_report();
+	threads_stack_report();
+	debug_report();
+	tasks_report();
+	temp_report();
+#if TIMER_PROFILE
+	timer_report();
+#endif
 }
 
 
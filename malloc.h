@@ -1,8 +0,0 @@
-#include <stdlib.h>
-
-#ifndef MALLOC_H
-#define MALLOC_H
-
-void *smalloc(size_t size);
-
-#endif
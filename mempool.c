@@ -1,42 +1,106 @@
-#include <malloc.h>
 #include <util/atomic.h>
 
 #include "mempool.h"
+#include "debug.h"
 
-#define block(pool,i) ( (mempool_block_t*)( ((uint8_t*)pool) + sizeof(*pool) + i*( sizeof(pool->blocks[0]) + pool->block_size) ) )
+#define MEMPOOL_REPORT_TAG 'M'
+
+#define block(pool,i) ( (mempool_block_t*)( ((uint8_t*)pool) + sizeof(*pool) + i*( sizeof(mempool_block_t) + pool->block_size) ) )
+
+//the free list link, kept in the buffer of a free block
+#define next(b) (*(mempool_block_t **)(b)->block)
 
 /**
  * Implement a reference counted memory pool allocator. The pool contains size
  * blocks of block_size. All blocks are reference counted with the reference
  * count being set to 1 on mempool_alloc(). Calls to mempool_getref() and
- * mempool_putref() increase and decrease the reference count, respectively.
+ * mempool_putref() increase and decrease the reference count, respectively;
+ * the block is freed when it drops to 0.
+ *
+ * Free blocks are kept in a singly linked list, so alloc and free are O(1).
+ *
+ * The storage comes from MEMPOOL_DEFINE(), which lays out the size blocks
+ * right after the pool; this links them, at boot.
  */
-mempool_t *init_mempool(const uint8_t block_size, const uint8_t size) {
-	mempool_t *pool;
-
-	pool = (mempool_t*)smalloc(sizeof(*pool) + size*(sizeof(mempool_block_t)+block_size));
+void init_mempool(mempool_t *pool, const uint8_t block_size, const uint8_t size) {
 	pool->size = size;
 	pool->block_size = block_size;
-	
-	for (uint8_t i = 0; i < block_size; ++i)
-		block(pool,i)->refcnt = 0;
+	pool->used = 0;
+	pool->high_water = 0;
+	pool->failures = 0;
+	pool->free = NULL;
 
-	return pool;
+	for (uint8_t i = size; i-- > 0;) {
+		block(pool,i)->refcnt = 0;
+		next(block(pool,i)) = pool->free;
+		pool->free = block(pool,i);
+	}
 }
 
+/**
+ * @return a block with a reference count of 1, or NULL if the pool is
+ * exhausted. Safe from interrupts.
+ */
 void *mempool_alloc(mempool_t *pool) {
+	mempool_block_t *block;
 	void *ret = NULL;
 	
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		for ( uint8_t i = 0; i < pool->size; ++i ) {
-			mempool_block_t * block = block(pool,i);
-			if ( block->refcnt == 0 ) {
-				ret = block->block;
-				block->refcnt = 1;
-				break;
-			}
+		block = pool->free;
+		if (block) {
+			pool->free = next(block);
+			block->refcnt = 1;
+			ret = block->block;
+
+			if (++pool->used > pool->high_water)
+				pool->high_water = pool->used;
+		} else {
+			pool->failures++;
 		}
 	}
 	
 	return ret;
 }
+
+/**
+ * Remove a reference to a block (i.e. decrement refcnt). This should be called
+ * one time to undo mempool_alloc then an additional time for each
+ * mempool_getref() call: the last one returns the block to the pool. Safe
+ * from interrupts.
+ */
+void mempool_putref(mempool_t *pool, void *buffer) {
+	mempool_block_t *block = __MEMPOOL_BLOCK(buffer);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (--block->refcnt == 0) {
+			next(block) = pool->free;
+			pool->free = block;
+			pool->used--;
+		}
+	}
+}
+
+/**
+ * Write the usage of a pool to the debug port, identified by id: the number
+ * of blocks, the blocks in use, the most ever in use, and the number of
+ * failed allocations.
+ */
+void mempool_report(mempool_t *pool, uint8_t id) {
+	struct {
+		uint8_t tag;
+		uint8_t id;
+		uint8_t size;
+		uint8_t used;
+		uint8_t high_water;
+		uint16_t failures;
+	} report = { MEMPOOL_REPORT_TAG, id, pool->size };
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		report.used = pool->used;
+		report.high_water = pool->high_water;
+		report.failures = pool->failures;
+	}
+
+	DEBUG_CHECK_LEN(report);
+	debug_write(&report, sizeof(report));
+}
@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <util/atomic.h>
 #ifndef MEMPOOL_H
 #define MEMPOOL_H
 
@@ -13,12 +14,43 @@ typedef struct {
 typedef struct {
 	uint8_t size;
 	uint8_t block_size;
-	mempool_block_t blocks[]; 
+
+	//free blocks, linked through their first bytes
+	mempool_block_t *free;
+
+	//blocks in use, most blocks ever in use, and failed allocations
+	uint8_t used;
+	uint8_t high_water;
+	uint16_t failures;
 } mempool_t;
 
-mempool_t *init_mempool(const uint8_t buffsize, const uint8_t blocks);
+/**
+ * Define a pool of n blocks of type, in .bss: name is a mempool_t * to it,
+ * to be set up with MEMPOOL_INIT(name) at boot. A block is the refcount
+ * followed by the buffer, which also holds the free list link.
+ */
+#define MEMPOOL_DEFINE(name, type, n) \
+	static struct { \
+		mempool_t pool; \
+		struct { \
+			uint8_t refcnt; \
+			union { \
+				type item; \
+				mempool_block_t *next; \
+			} block; \
+		} blocks[n]; \
+	} name##_storage; \
+	static mempool_t * const name = &name##_storage.pool
+
+#define MEMPOOL_INIT(name) \
+	init_mempool(name, sizeof(name##_storage.blocks[0].block), \
+		sizeof(name##_storage.blocks)/sizeof(name##_storage.blocks[0]))
+
+void init_mempool(mempool_t *pool, const uint8_t block_size, const uint8_t size);
 
 void *mempool_alloc(mempool_t *pool); 
+void mempool_putref(mempool_t *pool, void *buffer);
+void mempool_report(mempool_t *pool, uint8_t id);
 
 /**
  * Get a pointer to the block given membool_block_t.block (buffer)
@@ -26,31 +58,15 @@ void *mempool_alloc(mempool_t *pool);
 #define __MEMPOOL_BLOCK(buffer) \
 	((mempool_block_t *)((uint8_t*)(buffer)-offsetof(mempool_block_t,block)))
 
-#define __MEMPOOL_DECREF(buffer) do { \
-	__MEMPOOL_BLOCK(buffer)->refcnt--; \
-} while (0)
-
-#define __MEMPOOL_INCREF(buffer) do { \
-	__MEMPOOL_BLOCK(buffer)->refcnt++; \
-} while (0)
-
 /**
  * Get a "new" reference to a block. This should be called when copying the
- * data.
+ * data. Safe from interrupts.
  */
 static inline void * mempool_getref(void *buffer) {
-	__MEMPOOL_INCREF(buffer);
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		__MEMPOOL_BLOCK(buffer)->refcnt++;
+	}
 	return buffer;
 }
 
-/**
- * Remove a reference to a block (i.e. decrement refcnt). This should be called
- * one time to undo mempool_alloc then an additional time ffor each
- * mempool_getref() call. Excess calls to mempool_putref will result in a
- * memory leak.
- */
-static inline void mempool_putref(void *buffer) {
-	__MEMPOOL_DECREF(buffer);
-}
-
 #endif
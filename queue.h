@@ -1,21 +1,97 @@
 #include <stdint.h>
+#include <stddef.h>
 
 #ifndef QUEUE_H
 #define QUEUE_H
 
-typedef struct {
-	uint8_t size;
-	uint8_t read;
-	uint8_t write;
-	void *items[];
-} queue_t;
+/**
+ * Typed ring buffer. QUEUE_TYPE(name, type, size) declares name_t, a ring of
+ * size (a power of two <= 128) values of type stored inline, and the
+ * functions:
+ *
+ *   uint8_t name_offer(name_t *q, type item)   - 1 if queued, 0 if full
+ *   uint8_t name_poll(name_t *q, type *item)   - 1 if *item was set
+ *   type * name_peek(name_t *q)                - oldest item or NULL
+ *   uint8_t name_count(name_t *q)              - number of queued items
+ *   type * name_item(name_t *q, uint8_t i)     - i'th queued item, 0 = oldest
+ *   uint8_t name_drain(name_t *q, type *buf, uint8_t max)
+ *                                              - poll up to max items
+ *
+ * A zeroed name_t is an empty queue, so static instances need no
+ * initialization.
+ *
+ * The read and write indexes run freely and are masked on access. Only the
+ * producer writes q->write and only the consumer writes q->read, and each is
+ * a single byte store, so one producer and one consumer (e.g. an ISR and a
+ * task) need no locking. Several producers or several consumers must be
+ * serialized by the caller.
+ */
+#define QUEUE_TYPE(name, type, size) \
+	typedef char name##_size_must_be_power_of_two[ \
+		((size) > 0 && (size) <= 128 && ((size) & ((size)-1)) == 0) ? 1 : -1]; \
+	\
+	typedef struct { \
+		volatile uint8_t read; \
+		volatile uint8_t write; \
+		type items[size]; \
+	} name##_t; \
+	\
+	static inline uint8_t name##_count(name##_t *q) { \
+		return (uint8_t)(q->write - q->read); \
+	} \
+	\
+	static inline uint8_t name##_offer(name##_t *q, type item) { \
+		uint8_t write = q->write; \
+		if ((uint8_t)(write - q->read) == (size)) \
+			return 0; \
+		q->items[write & ((size)-1)] = item; \
+		queue_barrier(); \
+		q->write = write + 1; \
+		return 1; \
+	} \
+	\
+	static inline uint8_t name##_poll(name##_t *q, type *item) { \
+		uint8_t read = q->read; \
+		if (read == q->write) \
+			return 0; \
+		*item = q->items[read & ((size)-1)]; \
+		queue_barrier(); \
+		q->read = read + 1; \
+		return 1; \
+	} \
+	\
+	static inline type * name##_peek(name##_t *q) { \
+		uint8_t read = q->read; \
+		if (read == q->write) \
+			return NULL; \
+		return &q->items[read & ((size)-1)]; \
+	} \
+	\
+	static inline type * name##_item(name##_t *q, uint8_t i) { \
+		return &q->items[(uint8_t)(q->read + i) & ((size)-1)]; \
+	} \
+	\
+	static inline uint8_t name##_drain(name##_t *q, type *buf, uint8_t max) { \
+		uint8_t read = q->read; \
+		uint8_t write = q->write; \
+		uint8_t n = 0; \
+		while (n < max && read != write) \
+			buf[n++] = q->items[read++ & ((size)-1)]; \
+		queue_barrier(); \
+		q->read = read; \
+		return n; \
+	}
 
+/**
+ * QUEUE_TYPE() and a static (zeroed, so empty) instance var of it.
+ */
+#define QUEUE_DEFINE(name, type, size, var) \
+	QUEUE_TYPE(name, type, size) \
+	static name##_t var
 
-queue_t *queue_create(const uint8_t size);
-uint8_t queue_offer(queue_t *queue, void *data);
-void *queue_poll(queue_t *queue);
-void *queue_peek(queue_t *queue);
-
-#define queue_next_idx(idx,size) ((idx == size-1) ? 0 : idx+1)
+/**
+ * Keeps the compiler from moving item accesses past the index update.
+ */
+#define queue_barrier() asm volatile("" ::: "memory")
 
 #endif
@@ -0,0 +1,41 @@
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "stopwatch.h"
+#include "config.h"
+
+/**
+ * The low half counts the peripheral clock; its overflow is routed through
+ * an event channel to clock the high half. No interrupts are involved, so
+ * the counter does not wake the CPU from idle.
+ */
+void stopwatch_init(void) {
+	STOPWATCH_EVSYS_MUX = STOPWATCH_EVSYS_SRC;
+
+	STOPWATCH_TC_HIGH.CTRLA = TC_CLKSEL_OFF_gc;
+	STOPWATCH_TC_LOW.CTRLA = TC_CLKSEL_OFF_gc;
+	STOPWATCH_TC_HIGH.CNT = 0;
+	STOPWATCH_TC_LOW.CNT = 0;
+	STOPWATCH_TC_HIGH.PER = 0xFFFF;
+	STOPWATCH_TC_LOW.PER = 0xFFFF;
+
+	STOPWATCH_TC_HIGH.CTRLA = STOPWATCH_EVSYS_CLKSEL;
+	STOPWATCH_TC_LOW.CTRLA = TC_CLKSEL_DIV64_gc;
+}
+
+/**
+ * Read the counter. The high half is read twice to detect a carry from the
+ * low half between the two reads. Interrupts are disabled since 16 bit
+ * reads go through the (shared) TEMP register.
+ */
+uint32_t stopwatch_now(void) {
+	uint16_t high, low;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		do {
+			high = STOPWATCH_TC_HIGH.CNT;
+			low = STOPWATCH_TC_LOW.CNT;
+		} while (high != STOPWATCH_TC_HIGH.CNT);
+	}
+
+	return ((uint32_t)high<<16) | low;
+}
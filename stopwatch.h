@@ -0,0 +1,16 @@
+#include <stdint.h>
+#ifndef STOPWATCH_H
+#define STOPWATCH_H
+
+/**
+ * Free-running 32 bit counter used to time intervals. Ticks are
+ * F_CPU/STOPWATCH_DIV: 2us at 32MHz, wrapping after ~2.4 hours. Only
+ * differences between two readings are meaningful.
+ */
+#define STOPWATCH_DIV 64
+#define STOPWATCH_HZ (F_CPU/STOPWATCH_DIV)
+
+void stopwatch_init(void);
+uint32_t stopwatch_now(void);
+
+#endif
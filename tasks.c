@@ -1,21 +1,361 @@
+#include <util/atomic.h>
 #include "tasks.h"
 #include "queue.h"
+#include "error.h"
+#include "debug.h"
+#include "stopwatch.h"
+#include "config.h"
 
-static queue_t * event_queue;
+#if TASKS_PROFILE
+#include "timer.h"
+#endif
+
+#define TASKS_REPORT_TAG 'Q'
+
+/**
+ * Size of the run queue of each priority level (a power of two). The
+ * control level must be able to hold every control callback that can be
+ * pending at once: TASK_PRIO_HIGH callbacks always coalesce, so that is one
+ * entry per distinct callback and argument.
+ */
+#ifndef TASKS_QUEUE_SIZE
+#define TASKS_QUEUE_SIZE 8
+#endif
+
+/**
+ * Time after which a single call to tasks_run() starts no more
+ * TASK_PRIO_NORMAL/TASK_PRIO_LOW callbacks, in microseconds. At least one is
+ * started per call, so they cannot starve. TASK_PRIO_HIGH callbacks are not
+ * limited: the high queue is drained before each lower priority callback is
+ * started.
+ */
+#ifndef TASKS_BUDGET_US
+#define TASKS_BUDGET_US 1000
+#endif
+#define TASKS_BUDGET_TICKS ((uint32_t)TASKS_BUDGET_US*(STOPWATCH_HZ/1000)/1000)
+
+/**
+ * Number of TASK_PRIO_HIGH callbacks taken off the queue at once.
+ */
+#define TASKS_BATCH 4
+
+/**
+ * Callbacks queued without an argument are stored as void (*)(void *) and
+ * called with a NULL argument, which they ignore.
+ */
+typedef struct {
+	void (*cb)(void *);
+	void * arg;
+#if TASKS_PROFILE
+	//stopwatch time when the callback was queued
+	uint32_t stamp;
+#endif
+} task_entry_t;
+
+QUEUE_TYPE(task_queue, task_entry_t, TASKS_QUEUE_SIZE)
+
+/**
+ * Callbacks are queued from tasks and from interrupts of every level, so
+ * producers are serialized in task_schedule_prio(). The only consumer is
+ * tasks_run().
+ */
+static task_queue_t run_queue[TASK_PRIO_LEVELS];
+static uint16_t overflows[TASK_PRIO_LEVELS];
+
+static inline void tasks_run_entry(task_entry_t * entry);
+
+#if TASKS_PROFILE
+/**
+ * Profiler: every queued callback is timestamped with the stopwatch. When it
+ * runs, the time spent waiting in the queue and the time spent running are
+ * added to the statistics of its callback. Times are in stopwatch ticks,
+ * saturated to 16 bits (~131ms).
+ *
+ * Histogram bucket i counts times below 16<<(2*i) ticks (32us, 128us, 512us,
+ * 2ms, 8ms); the last bucket counts everything else.
+ */
+#define TASKS_PROFILE_BUCKETS 6
+#define TASKS_PROFILE_TAG 'P'
+
+//time between two slots of a dump, so the debug port can keep up.
+#define TASKS_PROFILE_DUMP_TICKS 64
+
+typedef struct {
+	uint16_t min;
+	uint16_t max;
+	uint16_t hist[TASKS_PROFILE_BUCKETS];
+} tasks_stat_t;
+
+typedef struct {
+	void (*cb)(void *);
+	uint16_t count;
+	tasks_stat_t wait;
+	tasks_stat_t run;
+} tasks_profile_t;
+
+static tasks_profile_t profile[TASKS_PROFILE_SLOTS];
+
+static uint8_t dump_slot;
+
+static tasks_profile_t * tasks_profile_slot(void (*cb)(void *));
+static void tasks_stat_add(tasks_stat_t * stat, uint32_t ticks);
+static void tasks_profile_dump(void);
+static void tasks_profile_dump_next(void);
+#endif
 
 void tasks_init(void) {
-	event_queue = queue_create(10);
+#if TASKS_PROFILE
+	debug_register_command(TASKS_PROFILE_DUMP_CMD, tasks_profile_dump);
+#endif
 }
 
-void tasks_run(void) {
-	void (*cb)(void) = queue_poll(event_queue);
+/**
+ * Run pending callbacks, highest priority first.
+ *
+ * @return the number of callbacks that were run.
+ */
+uint8_t tasks_run(void) {
+	task_entry_t batch[TASKS_BATCH];
+	task_entry_t entry;
+	uint32_t start = stopwatch_now();
+	uint8_t lower = 0;
+	uint8_t ran = 0;
 
-	if (cb == (void*)0)
-		return;
+	while (1) {
+		uint8_t n = task_queue_drain(&run_queue[TASK_PRIO_HIGH], batch, TASKS_BATCH);
+
+		if (n) {
+			for (uint8_t i = 0; i < n; ++i)
+				tasks_run_entry(&batch[i]);
+
+			ran += n;
+			continue;
+		}
+
+		if (lower && stopwatch_now() - start >= TASKS_BUDGET_TICKS)
+			break;
+
+		uint8_t prio;
+		for (prio = TASK_PRIO_HIGH+1; prio < TASK_PRIO_LEVELS; ++prio) {
+			if (task_queue_poll(&run_queue[prio], &entry))
+				break;
+		}
+
+		if (prio == TASK_PRIO_LEVELS)
+			break;
+
+		lower = 1;
+		tasks_run_entry(&entry);
+		ran++;
+	}
+
+	return ran;
+}
+
+static inline void tasks_run_entry(task_entry_t * entry) {
+#if TASKS_PROFILE
+	tasks_profile_t * slot = tasks_profile_slot(entry->cb);
+	uint32_t start = stopwatch_now();
+
+	entry->cb(entry->arg);
+
+	if (slot != NULL) {
+		slot->count++;
+		tasks_stat_add(&slot->wait, start - entry->stamp);
+		tasks_stat_add(&slot->run, stopwatch_now() - start);
+	}
+#else
+	entry->cb(entry->arg);
+#endif
+}
+
+/**
+ * @return nonzero if any callback is queued.
+ */
+uint8_t tasks_pending(void) {
+	for (uint8_t prio = 0; prio < TASK_PRIO_LEVELS; ++prio) {
+		if (task_queue_count(&run_queue[prio]))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Queue a callback with an argument. Safe to call from interrupts. The
+ * argument may point to the caller's state or carry a small value cast to a
+ * pointer.
+ *
+ * @param flags the priority (TASK_PRIO_*), optionally or'd with
+ * TASK_COALESCE. TASK_PRIO_HIGH callbacks always coalesce.
+ *
+ * @return 0 on success (including a coalesced callback), -ENOMEM if the
+ * level was full (the overflow counter for the level is incremented and the
+ * callback is dropped). At TASK_PRIO_HIGH that means TASKS_QUEUE_SIZE is too
+ * small for the control callbacks: see tasks_report().
+ */
+int8_t task_schedule_arg(void (*cb)(void *), void * arg, uint8_t flags) {
+	task_entry_t entry = { .cb = cb, .arg = arg };
+	uint8_t prio = flags & TASK_PRIO_MASK;
+	uint8_t queued = 0;
+
+	if (prio >= TASK_PRIO_LEVELS)
+		return -EINVAL;
+
+	//control work already pending will run: one entry per callback is enough
+	if (prio == TASK_PRIO_HIGH)
+		flags |= TASK_COALESCE;
 
-	cb();
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		task_queue_t * queue = &run_queue[prio];
+
+		if (flags & TASK_COALESCE) {
+			for (uint8_t i = 0; i < task_queue_count(queue); ++i) {
+				task_entry_t * pending = task_queue_item(queue, i);
+				if (pending->cb == cb && pending->arg == arg) {
+					queued = 1;
+					break;
+				}
+			}
+		}
+
+		if (!queued) {
+#if TASKS_PROFILE
+			entry.stamp = stopwatch_now();
+#endif
+			queued = task_queue_offer(queue, entry);
+
+			if (!queued)
+				overflows[prio]++;
+		}
+	}
+
+	return queued ? 0 : -ENOMEM;
+}
+
+/**
+ * Queue a callback without an argument. Safe to call from interrupts.
+ *
+ * @param flags the priority, optionally or'd with TASK_COALESCE.
+ *
+ * @see task_schedule_arg()
+ */
+int8_t task_schedule_prio(void (*cb)(void), uint8_t flags) {
+	return task_schedule_arg((void (*)(void *))cb, NULL, flags);
 }
 
 void task_schedule(void (*cb)(void)) {
-	queue_offer(event_queue, cb);
+	task_schedule_prio(cb, TASK_PRIO_NORMAL);
+}
+
+/**
+ * @return the number of callbacks dropped because the level was full.
+ */
+uint16_t task_overflows(uint8_t prio) {
+	uint16_t count;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		count = overflows[prio];
+	}
+
+	return count;
+}
+
+/**
+ * Write the overflow counters of the levels, highest priority first, to the
+ * debug port. Any TASK_PRIO_HIGH overflow is a configuration error.
+ */
+void tasks_report(void) {
+	struct {
+		uint8_t tag;
+		uint16_t overflows[TASK_PRIO_LEVELS];
+	} report = { TASKS_REPORT_TAG };
+
+	for (uint8_t prio = 0; prio < TASK_PRIO_LEVELS; ++prio)
+		report.overflows[prio] = task_overflows(prio);
+
+	DEBUG_CHECK_LEN(report);
+	debug_write(&report, sizeof(report));
+}
+
+#if TASKS_PROFILE
+/**
+ * Find (or claim) the profile slot for a callback.
+ *
+ * @return the slot or NULL if all slots are used by other callbacks.
+ */
+static tasks_profile_t * tasks_profile_slot(void (*cb)(void *)) {
+	for (uint8_t i = 0; i < TASKS_PROFILE_SLOTS; ++i) {
+		tasks_profile_t * slot = &profile[i];
+
+		if (slot->cb == cb)
+			return slot;
+
+		if (slot->cb == NULL) {
+			slot->cb = cb;
+			slot->wait.min = 0xFFFF;
+			slot->run.min = 0xFFFF;
+			return slot;
+		}
+	}
+
+	return NULL;
+}
+
+static void tasks_stat_add(tasks_stat_t * stat, uint32_t ticks) {
+	uint16_t t = (ticks > 0xFFFF) ? 0xFFFF : ticks;
+	uint8_t bucket = 0;
+
+	if (t < stat->min)
+		stat->min = t;
+
+	if (t > stat->max)
+		stat->max = t;
+
+	for (uint16_t limit = 16; bucket < TASKS_PROFILE_BUCKETS-1 && t >= limit; limit <<= 2)
+		bucket++;
+
+	if (stat->hist[bucket] != 0xFFFF)
+		stat->hist[bucket]++;
+}
+
+/**
+ * Debug command handler: write the statistics of every callback to the debug
+ * port, one slot every TASKS_PROFILE_DUMP_TICKS.
+ */
+static void tasks_profile_dump(void) {
+	dump_slot = 0;
+	tasks_profile_dump_next();
+}
+
+static void tasks_profile_dump_next(void) {
+	if (dump_slot >= TASKS_PROFILE_SLOTS || profile[dump_slot].cb == NULL)
+		return;
+
+	tasks_profile_t * slot = &profile[dump_slot];
+
+	for (uint8_t kind = 0; kind < 2; ++kind) {
+		tasks_stat_t * stat = kind ? &slot->run : &slot->wait;
+		struct {
+			uint8_t tag;
+			uint8_t kind;
+			//word address, as in the map file divided by 2
+			uint16_t cb;
+			uint16_t count;
+			tasks_stat_t stat;
+		} report = {
+			TASKS_PROFILE_TAG,
+			kind ? 'r' : 'w',
+			(uint16_t)slot->cb,
+			slot->count,
+			*stat
+		};
+
+		DEBUG_CHECK_LEN(report);
+		debug_write(&report, sizeof(report));
+	}
+
+	dump_slot++;
+	add_deferred_timer(tasks_profile_dump_next, TASKS_PROFILE_DUMP_TICKS, 1, TASK_PRIO_LOW);
 }
+#endif
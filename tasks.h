@@ -1,9 +1,32 @@
-#include "queue.h"
+#include <stdint.h>
 #ifndef EVENTQ_H
 #define EVENTQ_H
 
+/**
+ * Task priority levels. Lower value = higher priority. Everything queued at
+ * TASK_PRIO_HIGH runs before any lower level callback is started, and always
+ * coalesces so the level cannot overflow; the lower levels share a per-call
+ * time budget of TASKS_BUDGET_US.
+ */
+#define TASK_PRIO_HIGH 0
+#define TASK_PRIO_NORMAL 1
+#define TASK_PRIO_LOW 2
+#define TASK_PRIO_LEVELS 3
+
+/**
+ * Flag for task_schedule_arg(): do not queue the callback if the same
+ * callback with the same argument is already pending at that priority.
+ */
+#define TASK_COALESCE 0x80
+#define TASK_PRIO_MASK 0x03
+
 void tasks_init(void);
-void tasks_run(void);
+uint8_t tasks_run(void);
+uint8_t tasks_pending(void);
 void task_schedule(void (*cb)(void));
+int8_t task_schedule_prio(void (*cb)(void), uint8_t flags);
+int8_t task_schedule_arg(void (*cb)(void *), void * arg, uint8_t flags);
+uint16_t task_overflows(uint8_t prio);
+void tasks_report(void);
 
 #endif
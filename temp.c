@@ -7,89 +7,425 @@
 #include "timer.h"
 #include "tasks.h"
 #include "threads.h"
+#include "coro.h"
 #include "ds2483.h"
 #include "ds18b20.h"
 #include "error.h"
+#include "stopwatch.h"
+#include "debug.h"
 #include "config.h"
 
+#define TEMP_REPORT_TAG 'O'
+
 #define _CONCAT3(a,b,c) a##b##c
 #define _PIN(id) _CONCAT3(PIN,id,_bm)
 
-static ds2483_dev_t *onewiredev;
+static twi_master_t onewire_twim;
+static ds2483_dev_t onewire_dev;
+static ds2483_dev_t * const onewiredev = &onewire_dev;
+
+/**
+ * Sensors found by the ROM search, in search order, and their last readings.
+ * The search runs again when none is found or the bus fails.
+ */
+static uint8_t roms[TEMP_MAX_SENSORS][ONEWIRE_ROM_SIZE];
+static uint8_t sensors;
+static int8_t temp_error[TEMP_MAX_SENSORS];
+static int16_t temp[TEMP_MAX_SENSORS];
+
+/**
+ * State of the temperature coroutine. Everything that must survive a wait
+ * lives here rather than on a stack.
+ */
+static struct {
+	coro_t co;
+	coro_t ds18b20;
+	volatile uint8_t sleeping;
+	//no timer was free for a sleep: temp_report() ends it instead
+	uint8_t stalled;
+	uint8_t stalls;
+	uint8_t done;
+	int8_t error;
+	int16_t temp;
+	//sensor being read
+	uint8_t sensor;
+
+	//resolution (in the session) and sampling period, set by the controller
+	ds18b20_session_t session;
+	timer_ticks_t period;
+	//start of the current cycle and of the conversion, duration of the
+	//last conversion (0 when unknown)
+	timer_time_t cycle;
+	timer_time_t converting;
+	timer_ticks_t conversion;
+
+	//cost of the reading in progress: I2C bytes and stopwatch ticks
+	uint16_t traffic;
+	uint32_t started;
+	uint16_t bytes;
+	uint32_t ticks;
+} sampler;
 
-static int8_t temp_error;
-static int16_t temp;
+//cost of the last complete reading, for temp_report()
+static struct {
+	uint16_t bytes;
+	uint32_t ticks;
+} cost;
 
-static void onewire_schedule(void);
-static void onewire_resume(void) __attribute__((naked));
-static inline void onewire_sleep(uint16_t);
+#if TEMP_THREAD
+static thread_wait_t temp_wait;
+#endif
+
+static int8_t temp_run(coro_t * co);
+static void temp_step(void);
+static void onewire_notify(void);
+static void temp_wake(void);
 static void onewire_init(void);
+static void temp_set_error(int8_t error);
+static void temp_sleep(timer_ticks_t ticks, uint16_t slack);
+static timer_ticks_t temp_conversion_ticks(void);
+static timer_ticks_t temp_poll_ticks(void);
+static timer_ticks_t temp_expected_ticks(void);
+static void temp_cost_begin(void);
+static void temp_cost_end(void);
 
 void temp_init(void) {
-	temp_error = -EINVAL;
+	temp_set_error(-EINVAL);
+	sampler.session.bits = TEMP_RESOLUTION;
+	sampler.period = TIMER_MS(TEMP_PERIOD_MS);
 	onewire_init();
-	task_schedule(onewire_schedule);
+	CORO_INIT(&sampler.co);
+	onewire_notify();
 }
 
 /**
- * Temperature monitoring thread.
+ * Temperature monitoring coroutine. Resumed by temp_step() whenever a TWI
+ * transaction completes or the timer expires.
+ *
+ * Each period, all the sensors start a conversion at once. The coroutine
+ * sleeps until shortly before the time the last conversion took, then polls
+ * read slots until the sensors release the bus, and reads them.
  */
-void temp_run(void) {
-	ds2483_rst(onewiredev);
+static int8_t temp_run(coro_t * co) {
+	CORO_BEGIN(co);
+
+	CORO_SPAWN(co, &onewiredev->op, ds2483_rst(onewiredev));
 
 	while(1) {
-		int8_t error;
-		error = ds18b20_start_conversion(onewiredev);
+		sampler.cycle = timer_now();
+		sampler.bytes = 0;
+		sampler.ticks = 0;
 
-		if (error) {
-			temp_error = error;
-			continue;
+		if (!sensors) {
+			CORO_SPAWN(co, &sampler.ds18b20, ds18b20_find(&sampler.ds18b20, onewiredev,
+						roms, TEMP_MAX_SENSORS, &sampler.sensor, &sampler.error));
+			sensors = sampler.sensor;
+			//devices may have been replaced
+			sampler.session.lost = 1;
+			if (!sensors)
+				temp_set_error(sampler.error ? sampler.error : -ENODEV);
 		}
 
-	
-		//@TODO: failsafe if ds18b20_* returns error
+		//every sensor converts at once
+		if (sensors) {
+			temp_cost_begin();
+			CORO_SPAWN(co, &sampler.ds18b20,
+					ds18b20_start_conversion(&sampler.ds18b20, onewiredev, &sampler.session,
+						&sampler.error));
+			temp_cost_end();
+			sampler.converting = timer_now();
+
+			if (sampler.error) {
+				temp_set_error(sampler.error);
+				sensors = 0;
+			}
+		}
 
-		//note: manual indicates max 750ms per conversion 
-		onewire_sleep(TEMP_SECONDS*TIMER_HZ);
+		if (sensors) {
+			//sleep until the conversion is about to end...
+#if TEMP_ONEWIRE_SLEEP
+			ds2483_sleep(onewiredev);
+#endif
+			temp_sleep(temp_expected_ticks(), 0);
+			CORO_WAIT_UNTIL(co, !sampler.sleeping);
+#if TEMP_ONEWIRE_SLEEP
+			ds2483_wake(onewiredev);
+#endif
 
-		//double operations are not atomic
-		int16_t tmp_temp;
-		error = ds18b20_read_temp(onewiredev,&tmp_temp);
-		if (!error) {
+			//...then poll until it has
+			while (1) {
+				temp_cost_begin();
+				CORO_SPAWN(co, &sampler.ds18b20, ds18b20_poll_conversion(&sampler.ds18b20,
+							onewiredev, &sampler.done, &sampler.error));
+				temp_cost_end();
+				if (sampler.error || sampler.done)
+					break;
+
+				if (timer_now() - sampler.converting > temp_conversion_ticks() + temp_poll_ticks()) {
+					sampler.error = -ETIMEDOUT;
+					break;
+				}
+
+				temp_sleep(temp_poll_ticks(), 0);
+				CORO_WAIT_UNTIL(co, !sampler.sleeping);
+			}
+
+			if (sampler.error) {
+				temp_set_error(sampler.error);
+				sensors = 0;
+			} else {
+				sampler.conversion = timer_now() - sampler.converting;
+			}
+		}
+
+		//then they are read one after the other
+		for (sampler.sensor = 0; sampler.sensor < sensors; ++sampler.sensor) {
+			temp_cost_begin();
+			CORO_SPAWN(co, &sampler.ds18b20,
+					ds18b20_read_temp(&sampler.ds18b20, onewiredev, &sampler.session,
+						sensors == 1 ? NULL : roms[sampler.sensor], TEMP_SHORT_READ,
+						&sampler.temp, &sampler.error));
+			temp_cost_end();
+
+			//double operations are not atomic
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+				if (!sampler.error)
+					temp[sampler.sensor] = sampler.temp;
+				temp_error[sampler.sensor] = sampler.error;
+			}
+		}
+
+		if (sensors) {
 			ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-				temp = tmp_temp;
+				cost.bytes = sampler.bytes;
+				cost.ticks = sampler.ticks;
 			}
+		}
 
-	
-			temp_error = 0;
-		} else {
-			temp_error = error;
+		//wait for the rest of the period, waking up to a quarter of it
+		//early so the timer can share a tick
+		if (timer_now() - sampler.cycle < sampler.period) {
+#if TEMP_ONEWIRE_SLEEP
+			ds2483_sleep(onewiredev);
+#endif
+			temp_sleep(sampler.period - (timer_now() - sampler.cycle), sampler.period / 4);
+			CORO_WAIT_UNTIL(co, !sampler.sleeping);
+#if TEMP_ONEWIRE_SLEEP
+			ds2483_wake(onewiredev);
+#endif
 		}
 	}
+
+	CORO_END(co);
 }
 
+/**
+ * The last reading of the first sensor, the one controlling the bath.
+ */
 int8_t get_temp(int16_t *temp_ret) {
-	*temp_ret = temp;
-	return temp_error;
+	return get_sensor_temp(0, temp_ret);
+}
+
+/**
+ * @return 0 if *temp_ret was set to the last reading of sensor, in 1/16th C,
+ * or a negative error code.
+ */
+int8_t get_sensor_temp(uint8_t sensor, int16_t *temp_ret) {
+	int8_t error;
+
+	if (sensor >= TEMP_MAX_SENSORS)
+		return -EINVAL;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		*temp_ret = temp[sensor];
+		error = temp_error[sensor];
+	}
+
+	return error;
+}
+
+/**
+ * @return the number of sensors found on the bus.
+ */
+uint8_t temp_sensors(void) {
+	return sensors;
+}
+
+/**
+ * Set the resolution of the sensors, from DS18B20_MIN_BITS to
+ * DS18B20_MAX_BITS. The conversion time halves with each bit less. Applies
+ * from the next conversion.
+ */
+int8_t temp_set_resolution(uint8_t bits) {
+	if (bits < DS18B20_MIN_BITS || bits > DS18B20_MAX_BITS)
+		return -EINVAL;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		sampler.session.bits = bits;
+		sampler.conversion = 0;
+	}
+	return 0;
+}
+
+/**
+ * Set the sampling period, in milliseconds. A period shorter than the
+ * conversion time of the resolution makes the sensors sample back to back.
+ * Applies from the next period.
+ */
+int8_t temp_set_period(uint16_t ms) {
+	if (!ms)
+		return -EINVAL;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		sampler.period = ((uint32_t)ms*TIMER_HZ + 999)/1000;
+	}
+	return 0;
+}
+
+static void temp_set_error(int8_t error) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		for (uint8_t i = 0; i < TEMP_MAX_SENSORS; ++i)
+			temp_error[i] = error;
+	}
+}
+
+/**
+ * Write the cost of the last reading (conversion start, polls and result
+ * reads, not the waits in between) to the debug port: I2C bytes and
+ * microseconds, and the sleeps that found no timer free.
+ *
+ * Also resumes the sampler if it is stalled on such a sleep.
+ */
+void temp_report(void) {
+	struct {
+		uint8_t tag;
+		uint16_t bytes;
+		uint32_t us;
+		uint8_t stalls;
+	} report = { TEMP_REPORT_TAG };
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		report.bytes = cost.bytes;
+		report.us = cost.ticks * (1000000UL/STOPWATCH_HZ);
+	}
+	report.stalls = sampler.stalls;
+
+	DEBUG_CHECK_LEN(report);
+	debug_write(&report, sizeof(report));
+
+	if (sampler.stalled) {
+		sampler.stalled = 0;
+		temp_wake();
+	}
+}
+
+static void temp_cost_begin(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		sampler.traffic = onewire_twim.traffic;
+	}
+	sampler.started = stopwatch_now();
+}
+
+static void temp_cost_end(void) {
+	sampler.ticks += stopwatch_now() - sampler.started;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		sampler.bytes += onewire_twim.traffic - sampler.traffic;
+	}
 }
 
 static void onewire_init(void) {
-	twi_master_t *twim = twi_master_init(&ONEWIRE_TWI.MASTER, ONEWIRE_TWI_BAUD, NULL, NULL);
-	twi_master_set_blocking(twim, block, onewire_schedule);
-	onewiredev = ds2483_init(twim,&ONEWIRE_SLPZ_PORT,_PIN(ONEWIRE_SLPZ_PIN));
+	twi_master_init(&onewire_twim, &ONEWIRE_TWI.MASTER, &ONEWIRE_TWI_PORT, ONEWIRE_TWI_BAUD);
+	ds2483_init(onewiredev, &onewire_twim, &ONEWIRE_SLPZ_PORT, _PIN(ONEWIRE_SLPZ_PIN), onewire_notify);
+}
+
+#if TEMP_THREAD
+/**
+ * Temperature thread (TEMP_THREAD): resumes the coroutine each time it is
+ * signaled.
+ */
+void temp_thread(void) {
+	while (1) {
+		temp_run(&sampler.co);
+		thread_wait(&temp_wait);
+	}
+}
+
+static void temp_step(void) {
+	thread_signal(&temp_wait);
 }
 
-static inline void onewire_sleep(uint16_t ms) {
-	add_timer(onewire_schedule, ms, 1);
-	block();
+/**
+ * Resume the coroutine. Called from the TWI interrupt.
+ */
+static void onewire_notify(void) {
+	thread_signal(&temp_wait);
+}
+#else
+static void temp_step(void) {
+	temp_run(&sampler.co);
+}
+
+/**
+ * Resume the coroutine. Called from the TWI interrupt.
+ */
+static void onewire_notify(void) {
+	task_schedule_prio(temp_step, TASK_PRIO_NORMAL | TASK_COALESCE);
+}
+#endif
+
+/**
+ * Sleep for ticks, or up to slack more: resume with
+ * CORO_WAIT_UNTIL(co, !sampler.sleeping). If no timer is free, the sleep
+ * lasts until the next temp_report() and the readings fail with -ENOMEM.
+ */
+static void temp_sleep(timer_ticks_t ticks, uint16_t slack) {
+	timer_id_t id;
+
+	if (slack >= ticks)
+		slack = ticks - 1;
+	sampler.sleeping = 1;
+	id = add_deferred_timer(temp_wake, ticks - slack, 1, TASK_PRIO_NORMAL);
+	if (id > 0) {
+		timer_set_slack(id, slack);
+	} else {
+		//the readings go stale until temp_report() retries
+		sampler.stalled = 1;
+		sampler.stalls++;
+		temp_set_error(-ENOMEM);
+	}
 }
 
-static void onewire_schedule(void) {
-	task_schedule(onewire_resume);
+/**
+ * Maximum conversion time at the resolution written to the sensors.
+ */
+static timer_ticks_t temp_conversion_ticks(void) {
+	return (DS18B20_CONVERSION_US(sampler.session.written)*TIMER_HZ + 999999)/1000000;
 }
 
-static void onewire_resume(void) {
-	threads_switchto(1);
+/**
+ * Interval between polls for the end of a conversion: the conversion does
+ * not end more than that before the coroutine notices.
+ */
+static timer_ticks_t temp_poll_ticks(void) {
+	return temp_conversion_ticks()/16;
+}
+
+/**
+ * Time to the first poll: a poll before the last conversion completed, or
+ * half the maximum when that is unknown.
+ */
+static timer_ticks_t temp_expected_ticks(void) {
+	timer_ticks_t ticks = sampler.conversion ? sampler.conversion : temp_conversion_ticks()/2;
+
+	return ticks > temp_poll_ticks() ? ticks - temp_poll_ticks() : 1;
+}
+
+/**
+ * End of a wait: a deferred timer, so it runs as a task.
+ */
+static void temp_wake(void) {
+	sampler.sleeping = 0;
+	temp_step();
 }
 
 //@TODO!!!
@@ -1,6 +1,12 @@
+#include <stdint.h>
 #ifndef TEMP_H
 #define TEMP_H
 void temp_init(void);
-void temp_run(void);
 int8_t get_temp(int16_t *temp);
+int8_t get_sensor_temp(uint8_t sensor, int16_t *temp);
+uint8_t temp_sensors(void);
+int8_t temp_set_resolution(uint8_t bits);
+int8_t temp_set_period(uint16_t ms);
+void temp_report(void);
+void temp_thread(void);
 #endif
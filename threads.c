@@ -1,150 +1,443 @@
 #include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
 #include <util/atomic.h>
 #include "threads.h"
+#include "tasks.h"
+#include "debug.h"
+#include "error.h"
+#include "stopwatch.h"
+
+#define THREADS_REPORT_TAG 'S'
+#define THREADS_PREEMPT_REPORT_TAG 'R'
+
+//the preemption timer runs at F_CPU/1024
+#define THREADS_QUANTUM_TICKS ((uint16_t)((F_CPU/1024UL) * THREADS_QUANTUM_MS / 1000UL) - 1)
 
 static void * thread_stack_init(uint8_t * stack, void (*task)(void)); 
+static inline void threads_ready(uint8_t pid);
+static inline uint8_t threads_pop_ready(void);
+static inline void threads_paint_stack(tcb_t * tcb);
+#if THREADS_PREEMPT
+static void threads_preempt_init(void);
+static void threads_slice_end(uint8_t pid);
+#endif
 
 threads_t threads;
+#if THREADS_PREEMPT
+uint8_t threads_frame_in;
+#endif
 
-uint8_t thread_create(const char * name, void (*task)(void)) {
+/**
+ * Create a thread. Every thread except main (pid 0) is made ready
+ * immediately, so it starts running once the main thread runs tasks.
+ *
+ * @return the pid of the new thread or -ENOMEM if NUM_THREADS exist.
+ */
+int8_t thread_create(const char * name, void (*task)(void)) {
 	tcb_t * tcb;
-	uint8_t pid;
+	int8_t pid = -ENOMEM;
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		pid = threads.num++;
-		tcb = &threads.list[pid];
-		tcb->name = name;
-		tcb->pid = pid;
-		//new thread goes on the current top of stack
-		tcb->stack = thread_stack_init(threads.top_of_stack, task);
-		threads.top_of_stack = (void*)((uint16_t)tcb->stack - (uint16_t)THREADS_STACK_SIZE); 
+		if (threads.num < NUM_THREADS) {
+			pid = threads.num++;
+			tcb = &threads.list[pid];
+			tcb->name = name;
+			tcb->pid = pid;
+			//new thread goes on the current top of stack
+			tcb->stack_top = threads.top_of_stack;
+			tcb->stack = thread_stack_init(threads.top_of_stack, task);
+			threads.top_of_stack = (void*)((uint16_t)tcb->stack -
+					(pid == 0 ? THREADS_MAIN_STACK_SIZE : THREADS_STACK_SIZE));
+			tcb->stack_limit = (uint8_t*)threads.top_of_stack + 1;
+			threads_paint_stack(tcb);
+			tcb->frame = THREADS_FRAME_FAST;
+			tcb->prio = 0;
+
+			if (pid != 0)
+				threads_ready(pid);
+#if THREADS_PREEMPT
+			else
+				threads_preempt_init();
+#endif
+		}
 	}
 
 	return pid; 
 }
 
-void block(void) {
-	threads_switchto(0);
+/**
+ * Fill the unused part of a new stack (below the initial context) with the
+ * paint pattern and the canary.
+ *
+ * This is inlined into thread_create() on purpose: the main thread's stack
+ * is created just below the live stack of main(), so no deeper call frame
+ * may be used while painting it.
+ */
+static inline void threads_paint_stack(tcb_t * tcb) {
+	uint8_t * p = tcb->stack_limit;
+
+	for (uint8_t i = 0; i < THREADS_CANARY_SIZE; ++i)
+		*p++ = THREADS_CANARY;
+
+	while (p <= (uint8_t*)tcb->stack)
+		*p++ = THREADS_STACK_PAINT;
+
+	tcb->overflow = 0;
 }
 
-void * thread_stack_init(uint8_t * stack, void (*task)(void) ) {
-	*stack = 0x11; //38
-	stack--;
-	*stack = 0x22; //37
-	stack--;
-	*stack = 0x33; //36
-	stack--;
+/**
+ * Verify the canary of a thread that is being switched out. Called with
+ * interrupts disabled from the context switch.
+ */
+void threads_check_stack(tcb_t * tcb) {
+	for (uint8_t i = 0; i < THREADS_CANARY_SIZE; ++i) {
+		if (tcb->stack_limit[i] != THREADS_CANARY)
+			tcb->overflow = 1;
+	}
+}
 
-	uint16_t addr = (uint16_t)task;
+/**
+ * @return the maximum number of bytes the thread has used on its stack
+ * (including the initial context).
+ */
+uint16_t threads_stack_used(tcb_t * tcb) {
+	uint8_t * p = tcb->stack_limit + THREADS_CANARY_SIZE;
 
-	*stack = (addr&0xff); //35
-	stack--;
-	addr >>= 8;
+	while (p <= tcb->stack_top && *p == THREADS_STACK_PAINT)
+		p++;
 
-	*stack = (addr&0xff); //34
-	stack--;
+	return tcb->stack_top - p + 1;
+}
 
-#if defined(__AVR_3_BYTE_PC__) && __AVR_3_BYTE_PC__
-	*stack = 0; 
-	stack--;
+/**
+ * Write the stack high-water mark of each thread to the debug port, then the
+ * number of preemptions and the longest slice (in microseconds) when
+ * preemption is enabled.
+ */
+void threads_stack_report(void) {
+	for (uint8_t pid = 0; pid < threads.num; ++pid) {
+		tcb_t * tcb = &threads.list[pid];
+		struct {
+			uint8_t tag;
+			uint8_t pid;
+			uint16_t size;
+			uint16_t used;
+			uint8_t overflow;
+		} report = {
+			THREADS_REPORT_TAG,
+			pid,
+			tcb->stack_top - tcb->stack_limit + 1,
+			threads_stack_used(tcb),
+			tcb->overflow
+		};
+
+		DEBUG_CHECK_LEN(report);
+		debug_write(&report, sizeof(report));
+	}
+
+#if THREADS_PREEMPT
+	struct {
+		uint8_t tag;
+		uint16_t preemptions;
+		uint32_t slice_us;
+	} preempt = { THREADS_PREEMPT_REPORT_TAG };
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		preempt.preemptions = threads.preemptions;
+		preempt.slice_us = threads.slice_max;
+	}
+	preempt.slice_us *= 1000000UL/STOPWATCH_HZ;
+	DEBUG_CHECK_LEN(preempt);
+	debug_write(&preempt, sizeof(preempt));
 #endif
+}
 
-	*stack = 0x00; /*R0*/
-	stack--;
+/**
+ * Set the priority of a thread (0 is the highest). Of the threads that are
+ * ready, threads_resume() picks the highest priority one; threads of equal
+ * priority take turns.
+ */
+void thread_set_prio(uint8_t pid, uint8_t prio) {
+	if (pid < NUM_THREADS)
+		threads.list[pid].prio = prio;
+}
 
-	*stack = 0x80; /*SREG*/
-	stack--;
+/**
+ * Give up the CPU: switch back to the main thread.
+ */
+void block(void) {
+	thread_context_out_fast();
+	threads_switch_stack(THREADS_SWITCH_BLOCK);
+	thread_context_in_tcb();
+	asm volatile ("ret");
+}
 
-	*stack = 0x00; /*R1*/
-	stack--;
-	
-	*stack = 0x02; /*R2*/
-	stack--;
+/**
+ * Sleep on a wait object until it is signaled. Must not be called from the
+ * main thread.
+ */
+void thread_wait(thread_wait_t * wait) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (wait->signaled) {
+			wait->signaled = 0;
+			return;
+		}
 
-	*stack = 0x03; /*R3*/
-	stack--;
+		wait->pid = threads.tcb->pid;
+	}
 
-	*stack = 0x04; /*R4*/
-	stack--;
+	block();
+}
 
-	*stack = 0x05; /*R5*/
-	stack--;
+/**
+ * Wake the thread sleeping on a wait object. Safe to call from interrupts.
+ */
+void thread_signal(thread_wait_t * wait) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (wait->pid) {
+			threads_ready(wait->pid);
+			wait->pid = 0;
+		} else {
+			wait->signaled = 1;
+		}
+	}
+}
 
-	*stack = 0x06; /*R6*/
-	stack--;
+/**
+ * Mark a thread ready and queue a switch to it. At TASK_PRIO_HIGH the switch
+ * always coalesces, so it cannot be dropped: one pending threads_resume()
+ * serves every ready bit, since threads_pop_ready() queues another one while
+ * threads remain ready.
+ * Must be called with interrupts disabled.
+ */
+static inline void threads_ready(uint8_t pid) {
+	threads.ready |= 1<<pid;
+	task_schedule_prio(threads_resume, TASK_PRIO_HIGH | TASK_COALESCE);
+}
 
-	*stack = 0x07; /*R7*/
-	stack--;
+/**
+ * Must be called with interrupts disabled.
+ *
+ * @return the highest priority ready pid (which is no longer ready) or 0
+ * (main) if no thread is ready. Among equal priorities, the search starts
+ * after the thread picked last.
+ */
+static inline uint8_t threads_pop_ready(void) {
+	uint8_t best = 0;
+	uint8_t pid = threads.last;
+
+	for (uint8_t i = 1; i < NUM_THREADS; ++i) {
+		pid = (pid >= NUM_THREADS-1) ? 1 : pid+1;
+
+		if ((threads.ready & (1<<pid)) &&
+				(best == 0 || threads.list[pid].prio < threads.list[best].prio))
+			best = pid;
+	}
 
-	*stack = 0x08; /*R8*/
-	stack--;
+	if (best) {
+		threads.ready &= ~(1<<best);
+		threads.last = best;
 
-	*stack = 0x09; /*R9*/
-	stack--;
+		//the others get their turn when this one gives up the CPU
+		if (threads.ready)
+			task_schedule_prio(threads_resume, TASK_PRIO_HIGH | TASK_COALESCE);
+	}
 
-	*stack = 0x0a; /*R10*/
-	stack--;
+	return best;
+}
 
-	*stack = 0x0b; /*R11*/
-	stack--;
+/**
+ * Switch to the next ready thread. This is queued as a task by
+ * thread_signal(), so it always runs on the main thread.
+ */
+void threads_resume(void) {
+	thread_context_out_fast();
+	threads_switch_stack(THREADS_SWITCH_RESUME);
+	thread_context_in_tcb();
+	asm volatile ("ret");
+}
 
-	*stack = 0x0c; /*R12*/
-	stack--;
+/**
+ * The C half of every context switch, called by threads_switch_stack() once
+ * the outgoing thread's frame is on its stack: record it, check the canary
+ * and pick the thread to switch in. Runs on the outgoing stack with
+ * interrupts disabled.
+ *
+ * @return the stack pointer of the thread to switch in.
+ */
+void * threads_switch_next(void * sp, uint8_t reason) {
+	tcb_t * tcb = threads.tcb;
+	uint8_t pid = 0;
+
+	tcb->stack = sp;
+	tcb->frame = (reason == THREADS_SWITCH_PREEMPT) ?
+			THREADS_FRAME_FULL : THREADS_FRAME_FAST;
+	threads_check_stack(tcb);
+#if THREADS_PREEMPT
+	threads_slice_end(tcb->pid);
+#endif
 
-	*stack = 0x0d; /*R13*/
-	stack--;
+	if (reason == THREADS_SWITCH_RESUME) {
+		pid = threads_pop_ready();
+	} else if (reason == THREADS_SWITCH_PREEMPT) {
+		pid = tcb->pid;
+		if (pid != 0) {
+			threads.preemptions++;
+			threads_ready(pid);
+			pid = 0;
+		}
+	}
 
-	*stack = 0x0e; /*R14*/
-	stack--;
+	tcb = &threads.list[pid];
+	threads.tcb = tcb;
+#if THREADS_PREEMPT
+	threads_frame_in = tcb->frame;
+#endif
+	threads_slice_start(pid);
 
-	*stack = 0x0f; /*R15*/
-	stack--;
+	return tcb->stack;
+}
 
-	*stack = 0x10; /*R16*/
-	stack--;
+#if THREADS_PREEMPT
+/**
+ * Called from thread_create() for the main thread. The timer runs all the
+ * time; only its interrupt is switched on and off.
+ */
+static void threads_preempt_init(void) {
+	THREADS_PREEMPT_TC.CTRLA = TC_CLKSEL_OFF_gc;
+	THREADS_PREEMPT_TC.INTCTRLA = 0;
+	THREADS_PREEMPT_TC.CNT = 0;
+	THREADS_PREEMPT_TC.PER = THREADS_QUANTUM_TICKS;
+	THREADS_PREEMPT_TC.CTRLA = TC_CLKSEL_DIV1024_gc;
+}
 
-	*stack = 0x11; /*R17*/
-	stack--;
+/**
+ * Start the time slice of the thread being switched in. Main is never
+ * preempted (it runs the tasks), so its slice is unlimited and the timer
+ * interrupt is off while it runs: it costs nothing unless a thread actually
+ * overruns its quantum. Must be called with interrupts disabled.
+ */
+void threads_slice_start(uint8_t pid) {
+	if (pid == 0) {
+		THREADS_PREEMPT_TC.INTCTRLA = 0;
+	} else {
+		THREADS_PREEMPT_TC.CNT = 0;
+		THREADS_PREEMPT_TC.INTFLAGS = TC1_OVFIF_bm;
+		THREADS_PREEMPT_TC.INTCTRLA = TC_OVFINTLVL_LO_gc;
+		threads.slice_start = stopwatch_now();
+	}
+}
 
-	*stack = 0x12; /*R18*/
-	stack--;
+/**
+ * End the time slice of a thread being switched out, keeping the longest.
+ * This is the latency the quantum bounds. Must be called with interrupts
+ * disabled.
+ */
+static void threads_slice_end(uint8_t pid) {
+	uint32_t slice;
+
+	if (pid != 0) {
+		slice = stopwatch_now() - threads.slice_start;
+		if (slice > threads.slice_max)
+			threads.slice_max = slice;
+	}
+}
 
-	*stack = 0x13; /*R19*/
-	stack--;
+/**
+ * The running thread used up its quantum: save its full context, make it
+ * ready again and go back to main. Main therefore gets the CPU at most
+ * THREADS_QUANTUM_MS after it switched to a thread.
+ *
+ * This is a low level interrupt, so it can only interrupt thread code, never
+ * another handler. reti is also correct for main's fast frame, which ends in
+ * the return address of its call to threads_resume().
+ */
+ISR(THREADS_PREEMPT_vect, ISR_NAKED) {
+	thread_context_out();
+	threads_switch_stack(THREADS_SWITCH_PREEMPT);
+	thread_context_in_tcb();
+	reti();
+}
 
-	*stack = 0x14; /*R20*/
-	stack--;
+#if THREADS_PREEMPT_TEST
+static thread_wait_t spin_wait;
 
-	*stack = 0x15; /*R21*/
-	stack--;
+/**
+ * Preemption test thread: never blocks while spinning, so only the
+ * preemption interrupt gives main the CPU back.
+ */
+static void threads_spin_thread(void) {
+	uint32_t start;
 
-	*stack = 0x16; /*R22*/
-	stack--;
+	while (1) {
+		thread_wait(&spin_wait);
 
-	*stack = 0x17; /*R23*/
-	stack--;
+		start = stopwatch_now();
+		while (stopwatch_now() - start < THREADS_PREEMPT_TEST_QUANTA *
+				THREADS_QUANTUM_MS * (STOPWATCH_HZ/1000UL))
+			;
+	}
+}
 
-	*stack = 0x18; /*R24*/
-	stack--;
+static void threads_spin_command(void) {
+	thread_signal(&spin_wait);
+}
 
-	*stack = 0x19; /*R25*/
+/**
+ * Create the spin thread, below every other thread's priority, and
+ * register THREADS_PREEMPT_TEST_CMD to start it.
+ */
+void threads_preempt_test_init(void) {
+	int8_t pid = thread_create("spin", threads_spin_thread);
+
+	if (pid > 0) {
+		thread_set_prio(pid, 1);
+		debug_register_command(THREADS_PREEMPT_TEST_CMD, threads_spin_command);
+	}
+}
+#endif
+#endif
+
+/**
+ * Build the initial stack of a thread: a return address to the thread's
+ * function below a fast (callee-saved) context frame, so the first switch to
+ * the thread "returns" into it.
+ */
+void * thread_stack_init(uint8_t * stack, void (*task)(void) ) {
+	*stack = 0x11; //24
+	stack--;
+	*stack = 0x22; //23
+	stack--;
+	*stack = 0x33; //22
 	stack--;
 
-	*stack = 0x1a; /*R26*/
+	uint16_t addr = (uint16_t)task;
+
+	*stack = (addr&0xff); //21
 	stack--;
+	addr >>= 8;
 
-	*stack = 0x1b; /*R27*/
+	*stack = (addr&0xff); //20
 	stack--;
 
-	*stack = 0x1c; /*R28*/
+#if defined(__AVR_3_BYTE_PC__) && __AVR_3_BYTE_PC__
+	*stack = 0; 
 	stack--;
+#endif
 
-	*stack = 0x1d; /*R29*/
+	*stack = 0x80; /*SREG*/
 	stack--;
 
-	*stack = 0x1e; /*R30*/
+	//r2-r17 and r28-r29 hold their register number
+	for (uint8_t r = 2; r <= 17; ++r) {
+		*stack = r;
+		stack--;
+	}
+
+	*stack = 0x1c; /*R28*/
 	stack--;
 
-	*stack = 0x1f; /*R31*/
+	*stack = 0x1d; /*R29*/
 	stack--;
 
 	return stack;
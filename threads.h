@@ -1,26 +1,125 @@
+#include <stdint.h>
 #ifndef THREADS_H
 #define THREADS_H
 
-#define THREADS_CONTEXT_SIZE 38
+#include "config.h"
+
+#ifndef THREADS_PREEMPT
+#define THREADS_PREEMPT 0
+#endif
+
+#ifndef THREADS_PREEMPT_TEST
+#define THREADS_PREEMPT_TEST 0
+#endif
+
+#if THREADS_PREEMPT_TEST && !THREADS_PREEMPT
+#error "THREADS_PREEMPT_TEST needs THREADS_PREEMPT"
+#endif
+
+/**
+ * Size of the initial stack of a thread: padding, the return address into
+ * the thread's function and a fast context frame (SREG, r2-r17, r28-r29).
+ */
+#define THREADS_CONTEXT_SIZE 24
+
+#if THREADS_PREEMPT
+//room for a full frame and the calls made by the preemption interrupt
+#define THREADS_STACK_SIZE 110
+#else
 #define THREADS_STACK_SIZE 70
+#endif
+
+/**
+ * The main thread (pid 0) runs every task and deferred timer callback, with
+ * printf among them, and any interrupt may nest on its stack.
+ */
+#ifndef THREADS_MAIN_STACK_SIZE
+#define THREADS_MAIN_STACK_SIZE 256
+#endif
+
+/**
+ * Layout of the context saved on a switched out thread's stack.
+ */
+#define THREADS_FRAME_FAST 0
+#define THREADS_FRAME_FULL 1
 
+/**
+ * Each stack is painted with THREADS_STACK_PAINT when the thread is created.
+ * The lowest THREADS_CANARY_SIZE bytes hold THREADS_CANARY instead, and are
+ * checked every time the thread is switched out.
+ */
+#define THREADS_STACK_PAINT 0xA5
+#define THREADS_CANARY 0x5A
+#define THREADS_CANARY_SIZE 2
+
+/**
+ * Maximum number of threads (including main). thread_create() fails once
+ * this many threads exist. Limited by the width of threads_t.ready.
+ */
 #ifndef NUM_THREADS
 #define NUM_THREADS 5
 #endif
 
+#if NUM_THREADS > 8
+#error "NUM_THREADS must be <= 8"
+#endif
+
+/**
+ * SRAM needed by the thread stacks, which threads_init_stack() and
+ * thread_create() carve below the stack of main() instead of .bss: room for
+ * the main thread's stack, NUM_THREADS-1 other stacks, the 16 bytes left to
+ * main() and main()'s own frame. The Makefile checks it plus the static data
+ * against the size of SRAM.
+ */
+#define THREADS_MAIN_FRAME 16
+#define THREADS_SRAM ((NUM_THREADS-1)*(THREADS_CONTEXT_SIZE+THREADS_STACK_SIZE) \
+		+ THREADS_CONTEXT_SIZE + THREADS_MAIN_STACK_SIZE + 16 + THREADS_MAIN_FRAME)
+
 typedef struct {
 	uint8_t pid;
 	void * stack;
 	const char * name;
+	//highest and lowest address of the stack region
+	uint8_t * stack_top;
+	uint8_t * stack_limit;
+	//set when the canary was found overwritten
+	uint8_t overflow;
+	//THREADS_FRAME_*
+	uint8_t frame;
+	//0 is the highest priority
+	uint8_t prio;
 } tcb_t;
 
 typedef struct {
 	uint8_t num;
 	tcb_t * tcb;
 	void * top_of_stack;
+	//bitmask of threads waiting to be switched to by threads_resume()
+	volatile uint8_t ready;
+	//pid last switched to by threads_resume(), for round robin
+	uint8_t last;
+	//number of threads switched out by the preemption interrupt
+	uint16_t preemptions;
+#if THREADS_PREEMPT
+	//stopwatch time the running thread was switched in, and the longest
+	//a thread other than main has run before switching back
+	uint32_t slice_start;
+	uint32_t slice_max;
+#endif
 	tcb_t list[NUM_THREADS];	
 } threads_t;
 
+/**
+ * A wait object: one thread sleeps on it with thread_wait() and is woken by
+ * thread_signal() from an ISR or a task. A signal with no waiter is latched
+ * and consumed by the next thread_wait(). Zero-initialized means idle, since
+ * the main thread (pid 0) never waits.
+ */
+typedef struct {
+	volatile uint8_t pid;
+	volatile uint8_t signaled;
+} thread_wait_t;
+
 extern threads_t threads;
 
 /**
@@ -40,25 +139,86 @@ extern threads_t threads;
 
 #define threads_start_main() do {\
 		threads.tcb = &threads.list[0];\
-		thread_context_in();\
-		asm volatile ("ret");\
+		threads_slice_start(0);\
+		asm volatile(\
+			"out __SP_L__, %A0\n\t"\
+			"out __SP_H__, %B0\n\t"\
+			THREADS_POP_FAST\
+			"ret\n\t"\
+			: : "r" (threads.list[0].stack)\
+		);\
 	} while(0)
 
+/**
+ * Why a thread is being switched out, passed to threads_switch_next().
+ */
+#define THREADS_SWITCH_BLOCK 0
+#define THREADS_SWITCH_RESUME 1
+#define THREADS_SWITCH_PREEMPT 2
 
-#define threads_switchto(derp) do {\
-		thread_context_out();\
-		threads.tcb = &threads.list[derp];\
-		thread_context_in();\
-		asm volatile ("ret");\
-	} while(0)
+/**
+ * Hand the stack pointer of the thread that was just saved to
+ * threads_switch_next() and load the one it returns. Only valid in a naked
+ * function, between saving a context frame and restoring the next one: the
+ * call is plain asm, so the compiler never touches the registers in between.
+ */
+#define threads_switch_stack(reason)\
+	asm volatile(\
+		"in r24, __SP_L__\n\t"\
+		"in r25, __SP_H__\n\t"\
+		"ldi r22, %0\n\t"\
+		"call threads_switch_next\n\t"\
+		"out __SP_L__, r24\n\t"\
+		"out __SP_H__, r25\n\t"\
+		: : "M" (reason)\
+	)
 
-uint8_t thread_create(const char * name, void (*task)(void));
+int8_t thread_create(const char * name, void (*task)(void));
+void thread_set_prio(uint8_t pid, uint8_t prio);
 void block(void) __attribute__((naked));
+void threads_resume(void) __attribute__((naked));
+void thread_wait(thread_wait_t * wait);
+void thread_signal(thread_wait_t * wait);
+void threads_check_stack(tcb_t * tcb);
+void * threads_switch_next(void * sp, uint8_t reason);
+uint16_t threads_stack_used(tcb_t * tcb);
+void threads_stack_report(void);
+#if THREADS_PREEMPT_TEST
+void threads_preempt_test_init(void);
+#endif
+
+#if THREADS_PREEMPT
+void threads_slice_start(uint8_t pid);
+
+//frame of the thread picked by threads_switch_next(), read by the asm below
+extern uint8_t threads_frame_in;
 
-#define thread_context_in()                                \
+/**
+ * Restore the thread picked by threads_switch_next(), whichever way it was
+ * switched out. Followed by ret (or reti from an interrupt): both frames end
+ * in a return address.
+ */
+#define thread_context_in_tcb()\
 	asm volatile(\
-                    "out    __SP_L__, %A0            \n\t"    \
-                    "out    __SP_H__, %B0            \n\t"    \
+		"lds r0, threads_frame_in\n\t"\
+		"tst r0\n\t"\
+		"brne 1f\n\t"\
+		THREADS_POP_FAST\
+		"rjmp 2f\n\t"\
+		"1:\n\t"\
+		THREADS_POP_FULL\
+		"2:\n\t"\
+	)
+#else
+#define threads_slice_start(pid)
+#define thread_context_in_tcb() thread_context_in_fast()
+#endif
+
+/**
+ * Full context frame: r0, SREG and r1-r31 (33 bytes). Needed when a thread is
+ * switched out at an arbitrary instruction, i.e. from an interrupt.
+ */
+#define THREADS_POP_FULL                                   \
                     "pop    r31                      \n\t"    \
                     "pop    r30                      \n\t"    \
                     "pop    r29                      \n\t"    \
@@ -92,11 +252,9 @@ void block(void) __attribute__((naked));
                     "pop    r1                       \n\t"    \
                     "pop    r0                       \n\t"    \
                     "out    __SREG__, r0             \n\t"    \
-                    "pop    r0                       \n\t"    \
-					: : "e" (threads.tcb->stack) : \
-                )
-#define thread_context_out()                                   \
-    asm volatile (  "push    r0                     \n\t"    \
+                    "pop    r0                       \n\t"
+#define THREADS_PUSH_FULL                                  \
+                    "push    r0                     \n\t"    \
                     "in      r0, __SREG__           \n\t"    \
                     "cli                            \n\t"    \
                     "push    r0                     \n\t"    \
@@ -131,9 +289,62 @@ void block(void) __attribute__((naked));
                     "push    r28                    \n\t"    \
                     "push    r29                    \n\t"    \
                     "push    r30                    \n\t"    \
-                    "push    r31                    \n\t"    \
-                    "in      %A0, __SP_L__           \n\t"    \
-                    "in      %B0, __SP_H__           \n\t"    \
-					: "=e" (threads.tcb->stack) : :\
-                )
+                    "push    r31                    \n\t"
+#define thread_context_in() asm volatile(THREADS_POP_FULL)
+#define thread_context_out() asm volatile(THREADS_PUSH_FULL)
+
+
+/**
+ * Fast context frame for voluntary switches: SREG, r2-r17 and r28-r29 (19
+ * bytes). The switch is entered through a call, so the ABI already lets it
+ * clobber r0, r18-r27 and r30-r31, and r1 is known to be zero.
+ *
+ * Cycles on the XMEGA (push 1, pop 2), out + in, not counting the stack
+ * pointer switch: full: 36 + 67 = 103, fast: 21 + 39 = 60.
+ */
+#define THREADS_POP_FAST                                   \
+                    "pop    r29                      \n\t"    \
+                    "pop    r28                      \n\t"    \
+                    "pop    r17                      \n\t"    \
+                    "pop    r16                      \n\t"    \
+                    "pop    r15                      \n\t"    \
+                    "pop    r14                      \n\t"    \
+                    "pop    r13                      \n\t"    \
+                    "pop    r12                      \n\t"    \
+                    "pop    r11                      \n\t"    \
+                    "pop    r10                      \n\t"    \
+                    "pop    r9                       \n\t"    \
+                    "pop    r8                       \n\t"    \
+                    "pop    r7                       \n\t"    \
+                    "pop    r6                       \n\t"    \
+                    "pop    r5                       \n\t"    \
+                    "pop    r4                       \n\t"    \
+                    "pop    r3                       \n\t"    \
+                    "pop    r2                       \n\t"    \
+                    "pop    r0                       \n\t"    \
+                    "out    __SREG__, r0             \n\t"
+#define THREADS_PUSH_FAST                                  \
+                    "in      r0, __SREG__           \n\t"    \
+                    "cli                            \n\t"    \
+                    "push    r0                     \n\t"    \
+                    "push    r2                     \n\t"    \
+                    "push    r3                     \n\t"    \
+                    "push    r4                     \n\t"    \
+                    "push    r5                     \n\t"    \
+                    "push    r6                     \n\t"    \
+                    "push    r7                     \n\t"    \
+                    "push    r8                     \n\t"    \
+                    "push    r9                     \n\t"    \
+                    "push    r10                    \n\t"    \
+                    "push    r11                    \n\t"    \
+                    "push    r12                    \n\t"    \
+                    "push    r13                    \n\t"    \
+                    "push    r14                    \n\t"    \
+                    "push    r15                    \n\t"    \
+                    "push    r16                    \n\t"    \
+                    "push    r17                    \n\t"    \
+                    "push    r28                    \n\t"    \
+                    "push    r29                    \n\t"
+#define thread_context_in_fast() asm volatile(THREADS_POP_FAST)
+#define thread_context_out_fast() asm volatile(THREADS_PUSH_FAST)
 #endif
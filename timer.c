@@ -1,40 +1,125 @@
 #include <util/atomic.h>
 #include <stdlib.h>
-#include <stdbool.h>
 #include "timer.h"
-#include "mempool.h"
+#include "tasks.h"
+#include "error.h"
+#include "config.h"
 
-#define ATTR_ALWAYS_INLINE __attribute__ ((always_inline))
+#if TIMER_PROFILE
+#include "debug.h"
+#include "stopwatch.h"
+#endif
 
 #ifndef MAX_TIMERS
 #define MAX_TIMERS 8
 #endif
 
+/**
+ * Timers are kept in a hierarchical timing wheel of TIMER_LEVELS levels of
+ * TIMER_SLOTS slots each. A timer due in less than 16 ticks sits in level 0,
+ * in the slot of its expiry tick. A timer due in less than 16^(n+1) ticks
+ * sits in level n, in the slot covering its expiry. When the wheel reaches the
+ * start of that slot, its timers are cascaded into the lower levels. Adding
+ * and removing a timer is O(1), and a timer is cascaded at most
+ * TIMER_LEVELS-1 times.
+ *
+ * Free nodes are linked through next in a FIFO, so the nodes are reused in
+ * turn and their generations (see TIMER_ID()) advance evenly.
+ *
+ * The levels span 16 bits of ticks. A timer due further away is put in the
+ * last slot of level 3 and linked again, with its real expiry, when that slot
+ * is cascaded.
+ *
+ * A timer may allow some slack: it is then linked at the latest tick within
+ * the slack that is a multiple of the highest possible power of two. Timers
+ * with overlapping windows meet on the same tick and share one interrupt.
+ *
+ * The RTC runs freely and its overflow extends it to the 32 bit clock of
+ * timer_now(). Its compare interrupt is set to the next tick at which a slot
+ * must be processed, found through an occupancy bitmap per level.
+ */
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 4
+#define TIMER_SLOTS (1<<TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS-1)
+
+//no node: end of a list, or a timer that is not in a slot
+#define TIMER_NONE 0xFF
+
+//a compare value closer than this to RTC.CNT may be missed
+#define TIMER_MIN_DELAY 2
+
+#define TIMER_PROFILE_TAG 'T'
+
+//a timer_id_t is the node generation (16 bits) and index+1 (8 bits)
+#define TIMER_ID(i) (((timer_id_t)nodes[i].gen << 8) | ((i)+1))
+
+#if MAX_TIMERS >= TIMER_NONE
+#error "MAX_TIMERS must be < 255"
+#endif
+
+/**
+ * Callbacks added without a context are stored as void (*)(void *) and called
+ * with a NULL context, which they ignore.
+ */
 typedef struct {
-	void (*task)(void);
+	//NULL when the node is free
+	void (*task)(void *);
+	void * ctx;
 	timer_ticks_t freq;
-	timer_ticks_t ticks;
+	//timer_now() the timer is due at
+	timer_time_t expires;
+	//ticks the timer may run late, to share an interrupt with other timers
+	uint16_t slack;
 	//TIMER_RUN_UNLIMITED = infinite.
 	timer_lifetime_t lifetime;
-} timer_task;
-
-struct timer_node_st;
-typedef struct timer_node_st {
-	timer_task task;
-	struct timer_node_st *next;
-	struct timer_node_st *prev;
+	//TIMER_DEFER and task flags
+	uint8_t flags;
+	//level*TIMER_SLOTS + slot, or TIMER_NONE
+	uint8_t slot;
+	//next node in the slot, or in the free list
+	uint8_t next;
+	uint8_t prev;
+	//incremented when the node is freed, so stale ids are detected
+	uint16_t gen;
 } timer_node;
 
-static mempool_t *task_pool;
-static timer_node *task_list;
-static timer_ticks_t ticks;
+static timer_node nodes[MAX_TIMERS];
+static uint8_t wheel[TIMER_LEVELS*TIMER_SLOTS];
+static uint16_t occupied[TIMER_LEVELS];
+
+//high half of timer_now()
+static volatile uint16_t epoch;
+//tick up to which the wheel has been processed
+static timer_time_t wheel_time;
+//node whose callback is running, TIMER_NONE if none
+static uint8_t running;
+static uint8_t armed;
+//free list: taken from the head, freed nodes go to the tail
+static uint8_t free_head;
+static uint8_t free_tail;
+
+#if TIMER_PROFILE
+/**
+ * Worst ISR duration in stopwatch ticks, by number of armed timers: bucket 0
+ * is for no timer and bucket n for 2^(n-1) to 2^n-1 timers, so the record
+ * keeps its size whatever MAX_TIMERS is built with.
+ */
+#define TIMER_PROFILE_BUCKETS 8
+static uint16_t isr_max[TIMER_PROFILE_BUCKETS];
+//compare interrupts since the last report
+static uint16_t interrupts;
+#endif
 
-static inline void set_ticks(void) ATTR_ALWAYS_INLINE;
-static void __del_timer_node(timer_node *rm_node);
-static void __del_timer(void (*task_cb)(void));
-static void __add_timer_node(timer_node *node, uint8_t adjust);
-static timer_node *init_timer(void (*task_cb)(void), timer_ticks_t task_freq,
-		timer_lifetime_t task_lifetime);
+static uint8_t timer_lookup(timer_id_t id);
+static void timer_arm(uint8_t i, timer_ticks_t ticks);
+static void timer_free(uint8_t i);
+static timer_time_t timer_slack(timer_node *node);
+static void timer_link(uint8_t i);
+static void timer_unlink(uint8_t i);
+static uint8_t timer_next(uint16_t *delta);
+static void timer_expire(void);
+static void set_ticks(void);
 
 /**
  * Initialize the timers: run at boot.
@@ -44,212 +129,517 @@ void init_timers(void) {
 	//@TODO
 	RTC.CTRL = RTC_PRESCALER_DIV1_gc;
 	CLK.RTCCTRL = CLK_RTCSRC_RCOSC_gc /*CLK_RTCSRC_ULP_gc*/ | CLK_RTCEN_bm;
-	RTC.COMP = 1;
-	ticks = 1;
+
+	while (RTC.STATUS&RTC_SYNCBUSY_bm);
+	RTC.PER = 0xFFFF;
+	while (RTC.STATUS&RTC_SYNCBUSY_bm);
 	RTC.CNT = 0;
+	RTC.INTCTRL |= TIMER_OVERFLOW_ENABLE_BITS;
+
+	for (uint8_t i = 0; i < TIMER_LEVELS*TIMER_SLOTS; ++i)
+		wheel[i] = TIMER_NONE;
 
-	task_pool = init_mempool(sizeof(timer_node), MAX_TIMERS);
+	for (uint8_t i = 0; i < MAX_TIMERS; ++i)
+		nodes[i].next = i+1 < MAX_TIMERS ? i+1 : TIMER_NONE;
+	free_head = 0;
+	free_tail = MAX_TIMERS-1;
+
+	running = TIMER_NONE;
 }
 
 /**
- * Allocate memory for a timer and initialize the structure members.
- *
- * @see add_timer()
+ * @return the number of ticks since init_timers(). Safe to call from
+ * interrupts, including before the overflow interrupt has run.
  */
-static timer_node *init_timer(void (*task_cb)(void), timer_ticks_t task_freq,
-		timer_lifetime_t task_lifetime) {
-
-	timer_node *node = mempool_alloc(task_pool);
+timer_time_t timer_now(void) {
+	uint16_t high, low;
 
-	if (node == NULL)
-		return NULL;
-
-	timer_task *task = &(node->task);
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		high = epoch;
+		low = RTC.CNT;
 
-	task->task = task_cb;
-	task->freq = task_freq;
-	task->lifetime = task_lifetime;
-	task->ticks = task_freq;
-	node->prev = NULL;
-	node->next = NULL;
+		//the counter wrapped but the overflow interrupt has not run yet
+		if ((RTC.INTFLAGS & RTC_OVFIF_bm) && low < 0x8000)
+			high++;
+	}
 
-	return node;
+	return ((timer_time_t)high<<16) | low;
 }
 
 /**
- * Create and register a timer. Result is _undefined_ if called while executing
- * a timer.
+ * Create and register a timer with a context argument. Safe to call from
+ * interrupts and from timer callbacks.
  *
- * @param task_cb callback function to run when timer triggers.
+ * @param task_cb callback function to run when timer triggers, called with
+ * ctx.
  * @param task_freq frequency to trigger the timer.
  * @param task_lifetime number of times to trigger the timer (or TIMER_RUN_UNLIMITED).
+ * @param flags 0 to run the callback in the timer interrupt, or TIMER_DEFER
+ * or'd with task flags to queue it with task_schedule_arg().
+ *
+ * @return the id of the timer or -ENOMEM if MAX_TIMERS are armed.
  */
-void add_timer(void (*task_cb)(void), timer_ticks_t task_freq, timer_lifetime_t task_lifetime) {
-	timer_node * node = init_timer(task_cb, task_freq, task_lifetime);
+timer_id_t add_timer_ctx(void (*task_cb)(void *), void * ctx, timer_ticks_t task_freq, timer_lifetime_t task_lifetime, uint8_t flags) {
+	timer_id_t id = -ENOMEM;
 
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		__add_timer_node(node, 1);
-		set_ticks();
+		uint8_t i = free_head;
+
+		if (i != TIMER_NONE) {
+			timer_node *node = &nodes[i];
+
+			free_head = node->next;
+			if (free_head == TIMER_NONE)
+				free_tail = TIMER_NONE;
+
+			node->task = task_cb;
+			node->ctx = ctx;
+			node->freq = task_freq;
+			node->lifetime = task_lifetime;
+			node->flags = flags;
+			node->slack = 0;
+			timer_arm(i, task_freq);
+			armed++;
+			set_ticks();
+
+			id = TIMER_ID(i);
+		}
 	}
+
+	return id;
 }
 
 /**
- * Register a timer. This function MUST be called with interrupts disabled. If
- * it is called outside of the timer interrupt, adjust should be set to 1 to
- * indicate that the partial tick should be deducted from the timers. List
- * items are inserted in increasing order of # of ticks. It is assumed that the
- * added node has NULL ->next and ->prev.
+ * Create and register a timer.
  *
- * @param node the node to add to the list
- * @param adjust whether the current timers need to be adjusted.
+ * @see add_timer_ctx()
+ */
+timer_id_t add_timer(void (*task_cb)(void), timer_ticks_t task_freq, timer_lifetime_t task_lifetime) {
+	return add_timer_ctx((void (*)(void *))task_cb, NULL, task_freq, task_lifetime, 0);
+}
+
+/**
+ * Create and register a timer whose callback is queued as a task when it
+ * triggers, so it never runs in the timer interrupt.
+ *
+ * @param task_flags the task priority, optionally or'd with TASK_COALESCE.
  *
- * @see add_timer()
+ * @see add_timer_ctx()
  */
-static void __add_timer_node(timer_node *node, uint8_t adjust) {
-	if (task_list == NULL) {
-		task_list = node;
-		return;
-	}
+timer_id_t add_deferred_timer(void (*task_cb)(void), timer_ticks_t task_freq, timer_lifetime_t task_lifetime, uint8_t task_flags) {
+	return add_timer_ctx((void (*)(void *))task_cb, NULL, task_freq, task_lifetime, TIMER_DEFER | task_flags);
+}
+
+/**
+ * Cancel a timer. Safe to call from interrupts and from timer callbacks,
+ * including the callback of the timer itself.
+ *
+ * @return 0 on success, -EINVAL if the id does not refer to an armed timer
+ * (e.g. a one-shot timer that has already run).
+ */
+int8_t cancel_timer(timer_id_t id) {
+	int8_t ret = -EINVAL;
 
-	//if add_timer is called between ticks.
-	if (adjust) {
-		timer_node *cur = task_list;
-		while (cur != NULL) {
-			//this is probably unlikely to be false (though possible)
-			if (cur->task.ticks >= RTC.CNT)
-				cur->task.ticks -= RTC.CNT;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uint8_t i = timer_lookup(id);
+
+		if (i != TIMER_NONE) {
+			if (i == running)
+				running = TIMER_NONE;
 			else
-				cur->task.ticks = 0;
-			cur = cur->next;
+				timer_unlink(i);
+
+			timer_free(i);
+			set_ticks();
+			ret = 0;
 		}
 	}
 
-	//handle the case of replacing the head
-	if (task_list->task.ticks >= node->task.ticks) {
-		node->next = task_list;
-		task_list->prev = node;
-		task_list = node;
-	} else {
-		timer_node * tmp = task_list;
+	return ret;
+}
 
-		while (tmp->next != NULL && tmp->next->task.ticks < node->task.ticks)
-			tmp = tmp->next;
+/**
+ * Re-arm a timer to trigger ticks from now and every ticks after that. Its
+ * remaining lifetime is kept. Safe to call from interrupts and from timer
+ * callbacks; when a callback re-arms its own timer, the current run does not
+ * count against the lifetime.
+ *
+ * @return 0 on success, -EINVAL if the id does not refer to an armed timer.
+ */
+int8_t mod_timer(timer_id_t id, timer_ticks_t ticks) {
+	int8_t ret = -EINVAL;
 
-		node->next = tmp->next;
-		tmp->next = node;
-		node->prev = tmp;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uint8_t i = timer_lookup(id);
 
-		if (node->next != NULL)
-			node->next->prev = node;
+		if (i != TIMER_NONE) {
+			if (i == running)
+				running = TIMER_NONE;
+			else
+				timer_unlink(i);
+
+			nodes[i].freq = ticks;
+			timer_arm(i, ticks);
+			set_ticks();
+			ret = 0;
+		}
 	}
+
+	return ret;
 }
 
 /**
- * Set the number of ticks until the next interrupt.
+ * Let a timer run up to slack ticks late so it can share an interrupt with
+ * other timers. Kept when the timer is re-armed; for a periodic timer it
+ * applies to every period (without moving the deadlines).
  *
- * @TODO the RTC COMP/CNT size must be 16 bits?
- * this could get nasty otherwise.
+ * @return 0 on success, -EINVAL if the id does not refer to an armed timer.
  */
-static inline void set_ticks(void) {
-	if (task_list == NULL) {
-		TIMER_INTERRUPT_REGISTER &= ~TIMER_INTERRUPT_ENABLE_BITS;
-	} else {
-		//see xmegaA, p190. Results are insane if SYNCBUSY is not checked.
-		//(i.e. the values do not update)
-		while (RTC.STATUS&RTC_SYNCBUSY_bm);
-		RTC.CNT = 0;
-		RTC.COMP = task_list->task.ticks;
-		ticks = task_list->task.ticks;
-		TIMER_INTERRUPT_REGISTER |= TIMER_INTERRUPT_ENABLE_BITS;
+int8_t timer_set_slack(timer_id_t id, uint16_t slack) {
+	int8_t ret = -EINVAL;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		uint8_t i = timer_lookup(id);
+
+		if (i != TIMER_NONE) {
+			nodes[i].slack = slack;
+
+			if (i != running) {
+				timer_unlink(i);
+				timer_link(i);
+				set_ticks();
+			}
+
+			ret = 0;
+		}
 	}
+
+	return ret;
 }
 
 /**
- * Must be called with interrupts disabled.
+ * Delete the first timer found with the given callback (added without a
+ * context). Prefer cancel_timer().
  */
-static void __del_timer(void (*task_cb)(void)) {
-
-	timer_node *node = task_list;
+void del_timer(void (*task_cb)(void)) {
+	timer_id_t id = 0;
 
-	while (node != NULL) {
-		timer_node *next = node->next;
-		if (node->task.task == task_cb) {
-			__del_timer_node(node);
-			break;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		for (uint8_t i = 0; i < MAX_TIMERS; ++i) {
+			if (nodes[i].task == (void (*)(void *))task_cb) {
+				id = TIMER_ID(i);
+				break;
+			}
 		}
-		node = next;;
 	}
+
+	if (id)
+		cancel_timer(id);
 }
 
 /**
- * Delete a timer. Result is undefined if called while executing a timer.
+ * Must be called with interrupts disabled.
  *
- * @param task_cb the callback function registered in the timer.
+ * @return the node index of an armed timer, or TIMER_NONE if the id is
+ * stale or invalid.
  */
-void del_timer(void (*task_cb)(void)) {
-	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
-		__del_timer(task_cb);
-		set_ticks();
-	}
+static uint8_t timer_lookup(timer_id_t id) {
+	uint8_t i = (id & 0xFF) - 1;
+
+	if (id <= 0 || i >= MAX_TIMERS || nodes[i].task == NULL || TIMER_ID(i) != id)
+		return TIMER_NONE;
+
+	return i;
+}
+
+/**
+ * Link a node to trigger ticks from now.
+ * Must be called with interrupts disabled.
+ */
+static void timer_arm(uint8_t i, timer_ticks_t ticks) {
+	timer_time_t now = timer_now();
+	uint16_t delta;
+
+	//with nothing due, the wheel can be moved up to the current tick
+	if (!timer_next(&delta) || delta > now - wheel_time)
+		wheel_time = now;
+
+	nodes[i].expires = now + ticks;
+	timer_link(i);
+}
+
+/**
+ * Must be called with interrupts disabled.
+ */
+static void timer_free(uint8_t i) {
+	nodes[i].task = NULL;
+	nodes[i].gen++;
+	armed--;
+
+	nodes[i].next = TIMER_NONE;
+	if (free_tail != TIMER_NONE)
+		nodes[free_tail].next = i;
+	else
+		free_head = i;
+	free_tail = i;
+}
+
+/**
+ * @return the tick a timer runs at: the latest tick in
+ * [expires, expires+slack] that is a multiple of the highest power of two.
+ */
+static timer_time_t timer_slack(timer_node *node) {
+	timer_time_t limit = node->expires + node->slack;
+	timer_time_t diff = node->expires ^ limit;
+	timer_time_t mask = 0;
+
+	while (diff >>= 1)
+		mask = (mask << 1) | 1;
+
+	return limit & ~mask;
+}
+
+/**
+ * Put a node in the slot of its expiry (after slack), relative to
+ * wheel_time. Must be called with interrupts disabled.
+ */
+static void timer_link(uint8_t i) {
+	timer_node *node = &nodes[i];
+	timer_time_t expires = timer_slack(node);
+	uint8_t level = 0;
+
+	//beyond the last level: park in its furthest slot
+	if (expires - wheel_time > 0xFFFF)
+		expires = wheel_time + 0xFFFF;
+
+	uint16_t delta = expires - wheel_time;
+
+	while (level < TIMER_LEVELS-1 && (delta >> (TIMER_SLOT_BITS*(level+1))))
+		level++;
+
+	uint8_t slot = ((uint16_t)expires >> (TIMER_SLOT_BITS*level)) & TIMER_SLOT_MASK;
+	uint8_t *head = &wheel[level*TIMER_SLOTS + slot];
+
+	node->slot = level*TIMER_SLOTS + slot;
+	node->prev = TIMER_NONE;
+	node->next = *head;
+
+	if (*head != TIMER_NONE)
+		nodes[*head].prev = i;
+
+	*head = i;
+	occupied[level] |= 1U<<slot;
 }
 
 /**
- * Remove a timer node from the list.
+ * Take a node out of its slot.
  * Must be called with interrupts disabled.
  */
-static void __del_timer_node(timer_node *rm_node) {
-	if (rm_node == task_list) {
-		task_list = rm_node->next;
+static void timer_unlink(uint8_t i) {
+	timer_node *node = &nodes[i];
+
+	if (node->prev != TIMER_NONE)
+		nodes[node->prev].next = node->next;
+	else
+		wheel[node->slot] = node->next;
 
-	} else {
-		//this should always be true.
-		if (rm_node->prev != NULL)
-			rm_node->prev->next = rm_node->next;
+	if (node->next != TIMER_NONE)
+		nodes[node->next].prev = node->prev;
 
-		if (rm_node->next != NULL)
-			rm_node->next->prev = rm_node->prev;
+	if (wheel[node->slot] == TIMER_NONE)
+		occupied[node->slot / TIMER_SLOTS] &= ~(1U<<(node->slot & TIMER_SLOT_MASK));
+
+	node->slot = TIMER_NONE;
+}
+
+/**
+ * Find the next tick at which a slot has to be processed: the expiry of a
+ * level 0 slot or the start of a higher level slot.
+ * Must be called with interrupts disabled.
+ *
+ * @param delta set to the number of ticks from wheel_time.
+ *
+ * @return 0 if no timer is armed.
+ */
+static uint8_t timer_next(uint16_t *delta) {
+	uint8_t found = 0;
+
+	for (uint8_t level = 0; level < TIMER_LEVELS; ++level) {
+		uint16_t map = occupied[level];
+
+		if (map == 0)
+			continue;
+
+		uint8_t shift = TIMER_SLOT_BITS*level;
+		uint16_t wheel_low = wheel_time;
+		uint8_t cur = (wheel_low >> shift) & TIMER_SLOT_MASK;
+		//a level 0 slot may be due now, a higher level slot starts 1-16 slots ahead
+		uint8_t dist = level ? 1 : 0;
+
+		while (!(map & (1U<<((cur + dist) & TIMER_SLOT_MASK))))
+			dist++;
+
+		uint16_t base = wheel_low & ~((1U<<shift) - 1);
+		uint16_t d = base + ((uint16_t)dist << shift) - wheel_low;
+
+		if (!found || d < *delta) {
+			*delta = d;
+			found = 1;
+		}
 	}
 
-	mempool_putref(rm_node);
+	return found;
 }
 
 /**
- * Note that the list is rebuilt. This is to handle reordering of the list
- * items when node->task.ticks is reset to .freq. Due to this, a task cannot
- * modify timers while it is running; this must be deferred until outside of
- * timer interrupt context.
+ * Process the slots due at wheel_time: cascade the higher level slots that
+ * start here (highest first), then run the timers of the level 0 slot.
+ * Must be called with interrupts disabled.
  */
-TIMER_RUN {
-	timer_node *node;
-	timer_node *cur = task_list;
-	task_list = NULL;
+static void timer_expire(void) {
+	uint16_t wheel_low = wheel_time;
 
-	while (cur != NULL) {
-		node = cur;
-		cur = node->next;
+	for (uint8_t level = TIMER_LEVELS-1; level > 0; --level) {
+		uint8_t shift = TIMER_SLOT_BITS*level;
 
-		node->next = NULL;
-		node->prev = NULL;
+		if (wheel_low & ((1U<<shift) - 1))
+			continue;
 
-		if (node->task.ticks <= ticks) {
-			node->task.task();
+		uint8_t slot = (wheel_low >> shift) & TIMER_SLOT_MASK;
+		uint8_t *head = &wheel[level*TIMER_SLOTS + slot];
+		uint8_t i = *head;
 
-			if (node->task.lifetime != TIMER_RUN_UNLIMITED && --node->task.lifetime == 0) {
-				mempool_putref(node);
-			} else {
-				node->task.ticks = node->task.freq;
-				__add_timer_node(node,0);
-			}
+		*head = TIMER_NONE;
+		occupied[level] &= ~(1U<<slot);
+
+		while (i != TIMER_NONE) {
+			uint8_t next = nodes[i].next;
+			timer_link(i);
+			i = next;
+		}
+	}
+
+	uint8_t *head = &wheel[wheel_low & TIMER_SLOT_MASK];
+
+	//callbacks may add and delete timers, so take one node at a time
+	while (*head != TIMER_NONE) {
+		uint8_t i = *head;
+		timer_node *node = &nodes[i];
+
+		timer_unlink(i);
+		running = i;
+
+		if (node->flags & TIMER_DEFER)
+			task_schedule_arg(node->task, node->ctx, node->flags & ~TIMER_DEFER);
+		else
+			node->task(node->ctx);
+
+		//cancelled or re-armed by the callback
+		if (running != i)
+			continue;
+
+		running = TIMER_NONE;
+
+		if (node->lifetime != TIMER_RUN_UNLIMITED && --node->lifetime == 0) {
+			timer_free(i);
 		} else {
-			node->task.ticks -= ticks;
+			timer_ticks_t freq = node->freq ? node->freq : 1;
+
+			//periodic timers keep their phase: the next deadline is
+			//absolute, and whole periods missed while late are skipped
+			node->expires += freq;
+			if ((int32_t)(node->expires - wheel_time) < 0)
+				node->expires += ((wheel_time - node->expires) / freq + 1) * freq;
 
-			//@TODO this could possibly be done once with the entire tail
-			//inserted: since the remaining nodes are not run, they are already
-			//ordered correctly. This would require seeking to the tail of the
-			//list. The benefit is probably not worth it.
-			__add_timer_node(node,0);
+			timer_link(i);
 		}
 	}
+}
+
+/**
+ * Set the compare interrupt for the next slot to process.
+ * Must be called with interrupts disabled.
+ */
+static void set_ticks(void) {
+	uint16_t delta;
+
+	if (!timer_next(&delta)) {
+		TIMER_INTERRUPT_REGISTER &= ~TIMER_INTERRUPT_ENABLE_BITS;
+		return;
+	}
+
+	timer_time_t now = timer_now();
+	uint16_t comp = wheel_time + delta;
+
+	//overdue or too close to be caught by the compare
+	if (delta < now - wheel_time + TIMER_MIN_DELAY)
+		comp = now + TIMER_MIN_DELAY;
+
+	//see xmegaA, p190. Results are insane if SYNCBUSY is not checked.
+	//(i.e. the values do not update)
+	while (RTC.STATUS&RTC_SYNCBUSY_bm);
+	RTC.COMP = comp;
+	TIMER_INTERRUPT_REGISTER |= TIMER_INTERRUPT_ENABLE_BITS;
+}
+
+#if TIMER_PROFILE
+/**
+ * Write the number of compare interrupts since the last report and the worst
+ * case timer interrupt duration (in stopwatch ticks) for each bucket of
+ * armed timers to the debug port.
+ */
+void timer_report(void) {
+	struct {
+		uint8_t tag;
+		uint8_t max_timers;
+		uint16_t interrupts;
+		uint16_t isr_max[TIMER_PROFILE_BUCKETS];
+	} report = { TIMER_PROFILE_TAG, MAX_TIMERS };
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		report.interrupts = interrupts;
+		interrupts = 0;
+
+		for (uint8_t i = 0; i < TIMER_PROFILE_BUCKETS; ++i)
+			report.isr_max[i] = isr_max[i];
+	}
+
+	DEBUG_CHECK_LEN(report);
+	debug_write(&report, sizeof(report));
+}
+#endif
+
+/**
+ * Process every slot that is due by now (more may become due while callbacks
+ * run), then set the next compare.
+ */
+TIMER_RUN {
+	uint16_t delta;
+#if TIMER_PROFILE
+	uint8_t bucket = 0;
+	uint32_t start = stopwatch_now();
+
+	for (uint8_t count = armed; count && bucket < TIMER_PROFILE_BUCKETS-1; count >>= 1)
+		bucket++;
+
+	interrupts++;
+#endif
+
+	while (timer_next(&delta) && delta <= timer_now() - wheel_time) {
+		wheel_time += delta;
+		timer_expire();
+	}
 
 	set_ticks();
+
+#if TIMER_PROFILE
+	uint32_t ticks = stopwatch_now() - start;
+
+	if (ticks > isr_max[bucket])
+		isr_max[bucket] = (ticks > 0xFFFF) ? 0xFFFF : ticks;
+#endif
+}
+
+ISR(TIMER_OVERFLOW_VECTOR) {
+	epoch++;
 }
@@ -7,6 +7,8 @@
 #define TIMER_INTERRUPT_REGISTER RTC.INTCTRL
 #define TIMER_INTERRUPT_ENABLE_BITS RTC_COMPINTLVL_HI_gc
 #define TIMER_INTERRUPT_VECTOR RTC_COMP_vect
+#define TIMER_OVERFLOW_ENABLE_BITS RTC_OVFINTLVL_HI_gc
+#define TIMER_OVERFLOW_VECTOR RTC_OVF_vect
 
 #define TIMER_HZ 1024
 // the number of microseconds per tick.
@@ -14,15 +16,64 @@
 
 #define TIMER_RUN ISR(TIMER_INTERRUPT_VECTOR)
 
+/**
+ * value, if cond holds: otherwise fails to compile (negative array size).
+ * Both must be constants.
+ */
+#define TIMER_CHECKED(cond, value) ((value) + 0*sizeof(char[(cond) ? 1 : -1]))
+
+/**
+ * Ticks for a delay of at least ms milliseconds. ms must be a constant: a
+ * delay that does not fit in timer_ticks_t fails to compile.
+ */
+#define TIMER_MS(ms) ((timer_ticks_t)TIMER_CHECKED( \
+		((ms)*(uint64_t)TIMER_HZ + 999)/1000 <= UINT32_MAX, \
+		((ms)*(uint64_t)TIMER_HZ + 999)/1000))
+
 //used as argument 3 to timer_register 
 //to make the task run indefinitely.
 #define TIMER_RUN_UNLIMITED 0
 
-typedef uint16_t timer_ticks_t;
+/**
+ * Slack that lets a timer of one second or more run on a whole second tick
+ * of the RTC, together with the other timers that do.
+ */
+#define TIMER_SLACK_SECOND (TIMER_HZ-1)
+
+/**
+ * Timer flag: instead of running the callback in the timer interrupt, queue
+ * it as a task. Or'd with the task flags (TASK_PRIO_*, TASK_COALESCE) to
+ * queue it with.
+ */
+#define TIMER_DEFER 0x40
+
+typedef uint32_t timer_ticks_t;
 typedef uint8_t timer_lifetime_t;
 
+/**
+ * Ticks since init_timers(): the RTC counter extended to 32 bits by its
+ * overflow interrupt. Wraps after about 48 days.
+ */
+typedef uint32_t timer_time_t;
+
+/**
+ * Handle of an armed timer returned by add_timer(). Negative values are
+ * errors and 0 is never a valid id, so it can mean "no timer". An id becomes
+ * stale once its timer is cancelled or has run for its lifetime: holders
+ * should then set it to 0 rather than keep it, since a stale id matches
+ * again once its node has been reused 65536 times.
+ */
+typedef int32_t timer_id_t;
+
 void init_timers(void);
-void add_timer(void (*)(void), timer_ticks_t, timer_lifetime_t );
+timer_time_t timer_now(void);
+timer_id_t add_timer(void (*)(void), timer_ticks_t, timer_lifetime_t );
+timer_id_t add_timer_ctx(void (*)(void *), void *, timer_ticks_t, timer_lifetime_t, uint8_t flags);
+timer_id_t add_deferred_timer(void (*)(void), timer_ticks_t, timer_lifetime_t, uint8_t task_flags);
+int8_t cancel_timer(timer_id_t id);
+int8_t mod_timer(timer_id_t id, timer_ticks_t ticks);
+int8_t timer_set_slack(timer_id_t id, uint16_t slack);
 void del_timer(void (*)(void));
+void timer_report(void);
 
 #endif
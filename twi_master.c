@@ -1,34 +1,56 @@
 #include <string.h>
-#include <malloc.h>
+#include <util/atomic.h>
+#include <util/delay.h>
 #include <twi_master.h>
+#include "error.h"
 
 #define ATTR_ALWAYS_INLINE __attribute__ ((always_inline))
 static inline void twi_master_write_handler(twi_master_t * dev) ATTR_ALWAYS_INLINE;
 static inline void twi_master_read_handler(twi_master_t * dev) ATTR_ALWAYS_INLINE;
-static inline void twi_master_txn_complete(twi_master_t * dev, int8_t status) ATTR_ALWAYS_INLINE;
+static void twi_master_start(twi_master_t * dev);
+static void twi_master_next_segment(twi_master_t * dev, uint8_t ackact);
+static void twi_master_txn_complete(twi_master_t * dev, int8_t status);
+static void twi_master_timeout(void * ins);
+static void twi_master_recover(twi_master_t * dev);
 
 #ifndef TWI_MASTER_MAX_RETRIES
 	#define TWI_MASTER_MAX_RETRIES 3
 #endif
 
-#define twi_master_start_txn(dev) (dev)->twi->ADDR = (dev)->addr | ((dev)->txbytes ? 0 : 1)
+#ifndef TWI_MASTER_TIMEOUT
+	#define TWI_MASTER_TIMEOUT HRTIMER_US(2000)
+#endif
+
+//the TWI pins of a port, on every XMEGA A
+#define TWI_MASTER_SDA_bm PIN0_bm
+#define TWI_MASTER_SCL_bm PIN1_bm
+
+//half a period of the clock used to recover the bus (100kHz)
+#define TWI_MASTER_RECOVER_US 5
+
+#define twi_master_segment(dev) (&(dev)->head->segs[(dev)->seg])
 
+#define twi_master_start_segment(dev) do { \
+		twi_segment_t * _seg = twi_master_segment(dev); \
+		(dev)->bytes = 0; \
+		(dev)->traffic++; \
+		(dev)->twi->ADDR = (_seg->addr<<1) | (_seg->txbytes ? 0 : 1); \
+	} while (0)
 
-twi_master_t * twi_master_init(
+/**
+ * Initialize dev, which the caller allocates (statically), to drive twi,
+ * whose SDA and SCL pins are on port.
+ */
+void twi_master_init(
+			twi_master_t * dev,
 			TWI_MASTER_t * twi, 
-			const uint8_t baud, 
-			void * ins,
-			void (* txn_complete)(void *, int8_t)
+			PORT_t * port,
+			const uint8_t baud
 ) {
-	twi_master_t * dev;
-	dev = smalloc(sizeof *dev);
 	memset(dev, 0, sizeof *dev);
 
 	dev->twi = twi;
-	dev->txn_complete = txn_complete;
-	dev->ins = ins;
-	dev->block = NULL;
-	dev->resume = NULL;
+	dev->port = port;
 
 	/**
 	 * Master initialization
@@ -38,63 +60,106 @@ twi_master_t * twi_master_init(
 
 	//per AVR1308
 	twi->STATUS = TWI_MASTER_BUSSTATE_IDLE_gc;
-
-	return dev;
 }
 
-void twi_master_set_blocking(twi_master_t * dev, void (*block)(void), void (*resume)(void)) {
-	dev->block = block;
-	dev->resume = resume;
-}
+/**
+ * Queue a transaction. It starts at once if the bus is free, otherwise when
+ * the transactions queued before it (by any client) complete. txn->complete
+ * is called when it does, and may submit another transaction (or txn again).
+ *
+ * @return 0, or -EINVAL if txn has no segment or is already queued.
+ */
+int8_t twi_master_submit(twi_master_t * dev, twi_txn_t * txn) {
+	int8_t rc = 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (txn->nsegs == 0 || txn->status == TWI_MASTER_STATUS_PENDING) {
+			rc = -EINVAL;
+		} else {
+			txn->status = TWI_MASTER_STATUS_PENDING;
+			txn->next = NULL;
+
+			if (dev->head) {
+				dev->tail->next = txn;
+				dev->tail = txn;
+			} else {
+				dev->head = dev->tail = txn;
+				twi_master_start(dev);
+			}
+		}
+	}
 
-void twi_master_write(twi_master_t * dev, uint8_t addr, uint8_t len, uint8_t * buf) {
-	twi_master_write_read(dev,addr,len,buf,0,NULL);	
+	return rc;
 }
-   
-void twi_master_write_read(twi_master_t * dev, uint8_t addr, uint8_t txbytes, uint8_t * txbuf, uint8_t rxbytes, uint8_t * rxbuf) {
 
-	dev->txbuf = txbuf;
-	dev->txbytes = txbytes;
+/**
+ * Start the transaction at the head of the queue, if any. Interrupts must be
+ * disabled (or this is the TWI interrupt).
+ */
+static void twi_master_start(twi_master_t * dev) {
+	twi_txn_t * txn = dev->head;
 
-	dev->rxbuf = rxbuf;
-	dev->rxbytes = rxbytes;
+	if (!txn)
+		return;
 
-	dev->bytes = 0;
+	dev->seg = 0;
 	dev->retries = 0;
-	dev->addr = addr<<1;
+	hrtimer_start(&dev->timer, txn->timeout ? txn->timeout : TWI_MASTER_TIMEOUT,
+			twi_master_timeout, dev);
 
-	/**
-	 * @TODO check if it is busy here?
-	 */
-	twi_master_start_txn(dev);
-	if (dev->block)
-		dev->block();
+	//per AVR1308: the bus state is unknown after a reset or a recovery
+	if ((dev->twi->STATUS & TWI_MASTER_BUSSTATE_gm) == TWI_MASTER_BUSSTATE_UNKNOWN_gc)
+		dev->twi->STATUS = TWI_MASTER_BUSSTATE_IDLE_gc;
+
+	twi_master_start_segment(dev);
 }
 
+/**
+ * The current segment is done: go on with the next one, after a repeated
+ * start, or stop and complete the transaction. After a read, ackact is
+ * TWI_MASTER_ACKACT_bm to NACK the last byte.
+ */
+static void twi_master_next_segment(twi_master_t * dev, uint8_t ackact) {
+	if (++dev->seg < dev->head->nsegs) {
+		dev->retries = 0;
+		//the acknowledge action is sent before the repeated start
+		dev->twi->CTRLC = ackact;
+		twi_master_start_segment(dev);
+	} else {
+		dev->twi->CTRLC = ackact | TWI_MASTER_CMD_STOP_gc;
+		twi_master_txn_complete(dev, TWI_MASTER_STATUS_OK);
+	}
+}
 
-void twi_master_read(twi_master_t * dev, uint8_t addr, uint8_t len, uint8_t * buf) {
-	twi_master_write_read(dev,addr,0,NULL,len,buf);
+/**
+ * Retry the current segment after an error, up to TWI_MASTER_MAX_RETRIES
+ * times, or fail the transaction.
+ */
+static void twi_master_retry(twi_master_t * dev, int8_t status) {
+	if (dev->retries++ < TWI_MASTER_MAX_RETRIES) {
+		twi_master_start_segment(dev);
+	} else {
+		dev->twi->CTRLC = TWI_MASTER_CMD_STOP_gc;
+		twi_master_txn_complete(dev, status);
+	}
 }
 	
 void twi_master_isr(twi_master_t * dev) {
 	TWI_MASTER_t * twi = (TWI_MASTER_t*)dev->twi;
 
-	if ( (twi->STATUS & TWI_MASTER_ARBLOST_bm) || (twi->STATUS & TWI_MASTER_BUSERR_bm)) {
+	if (!dev->head) {
+		//completed by a timeout in the meantime
+		twi->CTRLC = TWI_MASTER_CMD_STOP_gc;
+	} else if ( (twi->STATUS & TWI_MASTER_ARBLOST_bm) || (twi->STATUS & TWI_MASTER_BUSERR_bm)) {
 		//per AVR1308 example code.
 		twi->STATUS |= TWI_MASTER_ARBLOST_bm;
 
 		/**
 		 * According to xmegaA, the master should be smart enough to wait 
 		 * until bussstate == idle before it tries to restart the transaction.
-		 * So in theory, this works. If it doesn't work, chances are the tx.state
-		 * will stay BUSY indefinitely.
+		 * If it does not, the timeout recovers the bus.
 		 */
-		if (dev->retries++ < TWI_MASTER_MAX_RETRIES) {
-			dev->bytes = 0;
-			twi_master_start_txn(dev);
-		} else {
-			twi_master_txn_complete(dev, -TWI_MASTER_STATUS_ABBR_LOST);
-		}
+		twi_master_retry(dev, -TWI_MASTER_STATUS_ABBR_LOST);
 	} else if ( twi->STATUS & TWI_MASTER_WIF_bm ) {
 		twi_master_write_handler(dev);
 	} else if (twi->STATUS & TWI_MASTER_RIF_bm) {
@@ -106,56 +171,106 @@ void twi_master_isr(twi_master_t * dev) {
 	}
 }
 
+/**
+ * A byte was received: acknowledge it if more are expected, otherwise NACK
+ * it and go on with the next segment.
+ */
 static inline void twi_master_read_handler(twi_master_t * dev) {
 	TWI_MASTER_t * twi = (TWI_MASTER_t*)dev->twi;
+	twi_segment_t * seg = twi_master_segment(dev);
 
-	if (dev->bytes < dev->rxbytes) {
-		dev->rxbuf[dev->bytes++] = twi->DATA;
-		twi->CTRLC = TWI_MASTER_CMD_RECVTRANS_gc;
+	if (dev->bytes < seg->rxbytes) {
+		seg->rxbuf[dev->bytes++] = twi->DATA;
+		dev->traffic++;
 	}
 
-	if (dev->bytes >= dev->rxbytes) { 
-		twi->CTRLC = TWI_MASTER_ACKACT_bm | TWI_MASTER_CMD_STOP_gc;
-		twi_master_txn_complete(dev, TWI_MASTER_STATUS_OK);
+	if (dev->bytes < seg->rxbytes) {
+		twi->CTRLC = TWI_MASTER_CMD_RECVTRANS_gc;
+	} else {
+		twi_master_next_segment(dev, TWI_MASTER_ACKACT_bm);
 	}
 }
 
 static inline void twi_master_write_handler(twi_master_t * dev) {
 	TWI_MASTER_t * twi = (TWI_MASTER_t*)dev->twi;
+	twi_segment_t * seg = twi_master_segment(dev);
 
 	//when it is read as 0, most recent ack bit was NAK. 
 	if (twi->STATUS & TWI_MASTER_RXACK_bm) {
-		//WHY IS THIS HERE??? <-- what you on about?
-		//and why is the busstate manually set?
-		twi->STATUS = TWI_MASTER_BUSSTATE_IDLE_gc;
-		if (dev->retries++ < TWI_MASTER_MAX_RETRIES) {
-			dev->bytes = 0;
-			twi_master_start_txn(dev);
-		} else {
-			twi->CTRLC = TWI_MASTER_CMD_STOP_gc;
-			twi_master_txn_complete(dev, -TWI_MASTER_STATUS_SLAVE_NAK);
-		}
+		twi_master_retry(dev, -TWI_MASTER_STATUS_SLAVE_NAK);
+	} else if ( dev->bytes < seg->txbytes ) {
+		twi->DATA = seg->txbuf[dev->bytes++];
+		dev->traffic++;
+	} else if (seg->rxbytes) {
+		//repeated start to read
+		dev->bytes = 0;
+		dev->traffic++;
+		twi->ADDR = (seg->addr<<1) | 1;
 	} else {
-		if ( dev->bytes < dev->txbytes ) {
-			twi->DATA = dev->txbuf[dev->bytes++];
-		} else {
-			twi->CTRLC = TWI_MASTER_CMD_STOP_gc;
-			twi->STATUS = TWI_MASTER_BUSSTATE_IDLE_gc;
-			
-			//send repeated start if bytes to read
-			if (dev->rxbytes) {
-				dev->bytes = 0;
-				twi->ADDR = dev->addr | 1;
-			} else {
-				twi_master_txn_complete(dev, TWI_MASTER_STATUS_OK);
-			}
-		}
+		twi_master_next_segment(dev, 0);
 	}
 }
 
-static inline void twi_master_txn_complete(twi_master_t * dev, int8_t status) {
-	if (dev->block)
-		dev->resume();
-	else 
-		dev->txn_complete(dev->ins,status);
+/**
+ * Remove the running transaction from the queue, start the next one and
+ * report its status. The next one starts first: a transaction submitted by
+ * the callback is then either queued behind it or, if the queue is empty,
+ * started by twi_master_submit() alone.
+ */
+static void twi_master_txn_complete(twi_master_t * dev, int8_t status) {
+	twi_txn_t * txn = dev->head;
+
+	hrtimer_cancel(&dev->timer);
+
+	dev->head = txn->next;
+	txn->status = status;
+	twi_master_start(dev);
+
+	if (txn->complete)
+		txn->complete(txn->ctx, status);
+}
+
+/**
+ * The running transaction took too long: the bus is most likely stuck, with
+ * a slave holding SDA low. Recover it and fail the transaction.
+ */
+static void twi_master_timeout(void * ins) {
+	twi_master_t * dev = ins;
+
+	if (!dev->head)
+		return;
+
+	twi_master_recover(dev);
+	twi_master_txn_complete(dev, -TWI_MASTER_STATUS_TIMEOUT);
+}
+
+/**
+ * Bus recovery: with the TWI module disabled, clock SCL 9 times so that a
+ * slave in the middle of a byte lets go of SDA, then send a stop.
+ */
+static void twi_master_recover(twi_master_t * dev) {
+	PORT_t * port = dev->port;
+
+	dev->twi->CTRLA &= ~TWI_MASTER_ENABLE_bm;
+
+	port->OUTSET = TWI_MASTER_SCL_bm;
+	port->DIRSET = TWI_MASTER_SCL_bm;
+	for (uint8_t i = 0; i < 9; ++i) {
+		_delay_us(TWI_MASTER_RECOVER_US);
+		port->OUTCLR = TWI_MASTER_SCL_bm;
+		_delay_us(TWI_MASTER_RECOVER_US);
+		port->OUTSET = TWI_MASTER_SCL_bm;
+	}
+
+	//stop: SDA rises while SCL is high
+	port->OUTCLR = TWI_MASTER_SCL_bm;
+	port->OUTCLR = TWI_MASTER_SDA_bm;
+	port->DIRSET = TWI_MASTER_SDA_bm;
+	_delay_us(TWI_MASTER_RECOVER_US);
+	port->OUTSET = TWI_MASTER_SCL_bm;
+	_delay_us(TWI_MASTER_RECOVER_US);
+	port->DIRCLR = TWI_MASTER_SDA_bm | TWI_MASTER_SCL_bm;
+
+	dev->twi->CTRLA |= TWI_MASTER_ENABLE_bm;
+	dev->twi->STATUS = TWI_MASTER_BUSSTATE_IDLE_gc;
 }
@@ -1,4 +1,5 @@
 #include <avr/io.h>
+#include "hrtimer.h"
 #ifndef TWI_MASTER_H
 #define TWI_MASTER_H
 
@@ -6,37 +7,83 @@
 #define TWI_MASTER_STATUS_OK 0
 #define TWI_MASTER_STATUS_ABBR_LOST 2
 #define TWI_MASTER_STATUS_SLAVE_NAK 3
+#define TWI_MASTER_STATUS_TIMEOUT 4
+//twi_txn_t.status while the transaction is queued or running
+#define TWI_MASTER_STATUS_PENDING 5
 
+/**
+ * One segment of a transaction: write txbytes to the slave at (7 bit) addr,
+ * then read rxbytes from it after a repeated start. Either count may be 0.
+ */
 typedef struct {
-	TWI_MASTER_t * twi;
-	void (* txn_complete)(void * ins, int8_t status);
-	void (*block)(void);
-	void (*resume)(void);
-	void * ins;
-	uint8_t * txbuf;
+	uint8_t addr;
 	uint8_t txbytes;
-
-	uint8_t * rxbuf;
+	uint8_t * txbuf;
 	uint8_t rxbytes;
+	uint8_t * rxbuf;
+} twi_segment_t;
+
+/**
+ * A transaction: nsegs segments run back to back, joined by repeated
+ * starts, and a single stop at the end. Descriptors are owned by the
+ * clients, which must not touch them while status is
+ * TWI_MASTER_STATUS_PENDING.
+ */
+struct twi_txn_struct;
+typedef struct twi_txn_struct {
+	struct twi_txn_struct * next;
+	twi_segment_t * segs;
+	uint8_t nsegs;
+
+	//for the whole transaction, in hrtimer ticks; 0 for TWI_MASTER_TIMEOUT
+	hrtimer_ticks_t timeout;
 
+	//called from the TWI (or hrtimer) interrupt with the final status:
+	//TWI_MASTER_STATUS_OK or minus one of the other codes
+	void (* complete)(void * ctx, int8_t status);
+	void * ctx;
+	volatile int8_t status;
+} twi_txn_t;
+
+typedef struct {
+	TWI_MASTER_t * twi;
+	PORT_t * port;
+
+	//queue of submitted transactions; head is running
+	twi_txn_t * head;
+	twi_txn_t * tail;
+
+	//position in the running transaction
+	uint8_t seg;
 	uint8_t bytes;
 	uint8_t retries;
 
-	/*currently addressed slave*/
-	uint8_t addr;
+	hrtimer_t timer;
+
+	//bytes moved on the bus, address bytes included; wraps
+	uint16_t traffic;
 } twi_master_t;
 
 
-twi_master_t * twi_master_init(
+void twi_master_init(
+			twi_master_t * dev,
 			TWI_MASTER_t * twi, 
-			const uint8_t baud, 
-			void * ins,
-			void (* txn_complete)(void *, int8_t));
+			PORT_t * port,
+			const uint8_t baud);
 
 void twi_master_isr(twi_master_t * dev);
 
-void twi_master_write_read(twi_master_t * dev, uint8_t addr, uint8_t txbytes, uint8_t * txbuf, uint8_t rxbytes, uint8_t * rxbuf);
-void twi_master_write(twi_master_t * dev, uint8_t addr, uint8_t len, uint8_t * buf); 
-void twi_master_read(twi_master_t * dev, uint8_t addr, uint8_t len, uint8_t * buf); 
-void twi_master_set_blocking(twi_master_t * twim,void (*block)(void), void (*resume)(void));
+int8_t twi_master_submit(twi_master_t * dev, twi_txn_t * txn);
+
+/**
+ * Fill a segment.
+ */
+static inline void twi_segment_set(twi_segment_t * seg, uint8_t addr,
+		uint8_t txbytes, uint8_t * txbuf, uint8_t rxbytes, uint8_t * rxbuf) {
+	seg->addr = addr;
+	seg->txbytes = txbytes;
+	seg->txbuf = txbuf;
+	seg->rxbytes = rxbytes;
+	seg->rxbuf = rxbuf;
+}
 #endif
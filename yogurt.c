@@ -14,6 +14,9 @@
 #define MIN(a,b) (((a) > (b))? (b) : (a))
 #define MAX(a,b) (((a) > (b))? (a) : (b))
 
+//wait before reading the temperature again when starting a cycle failed
+#define YOGURT_START_RETRY TIMER_MS(250)
+
 typedef struct {
 	//target temperature in 1/16th C
 	int16_t temperature;
@@ -35,8 +38,8 @@ typedef struct {
 	int16_t last_temp;
 	int16_t integral;
 
-	//counters in current state
-	//these only start when
+	//time in current state, derived from timer_now() and start
+	timer_time_t start;
 	uint16_t minutes;
 	uint8_t seconds;
 } yogurt_state_t;
@@ -49,19 +52,25 @@ static struct {
 	uint8_t alarm:1;
 } extras;
 
+static timer_id_t run_timer;
+static timer_id_t start_timer;
+static timer_id_t extras_timer;
+
 
 static inline uint8_t temp_in_interval(int16_t temp, int16_t a, int16_t b);
 static int8_t yogurt_temperature_control(int16_t *cur_temp);
 static inline int32_t yogurt_maintain_temperature(int32_t level, int16_t diff, int8_t diff_neg, int8_t diff_pos, int16_t *cur_temp);
 static inline int32_t yogurt_attain_temperature(int32_t level, int16_t diff, int8_t diff_neg, int8_t diff_pos, int16_t *cur_temp);
 static void yogurt_start(void);
-static void yogurt_run_upper(void);
-static void yogurt_run_lower(void);
-static void yogurt_extras_timer(void);
+static void yogurt_run(void);
 static void yogurt_extras(void);
+static void yogurt_update_time(void);
+static void yogurt_reset_time(void);
+static timer_id_t yogurt_add_second_timer(void (*cb)(void), uint8_t task_flags);
 static void yogurt_keyhandler(void);
 static int8_t yogurt_get_temp(int16_t *temp);
 static void yogurt_clear_state(void);
+static void yogurt_report(void);
 
 static void yogurt_print_status(int16_t temp, int16_t minutes, uint8_t seconds);
 static inline void yogurt_print_status_down(int16_t temp, int16_t cycle_minutes, int16_t cur_minutes, uint8_t cur_seconds);
@@ -87,10 +96,20 @@ void yogurt_init() {
 }
 
 static void yogurt_start() {
-	int8_t err = yogurt_get_temp(&control.last_temp);
+	int8_t err;
+
+	//a retry has run: its one-shot timer is gone
+	start_timer = 0;
+
+	err = yogurt_get_temp(&control.last_temp);
 	// keep retrying until a valid temperature is read
 	if (err) {
-		task_schedule(yogurt_start);
+		start_timer = add_deferred_timer(yogurt_start, YOGURT_START_RETRY, 1, TASK_PRIO_NORMAL);
+		if (start_timer < 0) {
+			start_timer = 0;
+			clear();
+			printf("Err");
+		}
 	} else {
 		control.integral = 0;
 		if (control.last_temp < control.cycle.temperature) {
@@ -103,26 +122,58 @@ static void yogurt_start() {
 		}
 
 		control.state = YOGURT_STATE_ATTAIN;
-		control.minutes = 0;
-		control.seconds = 0;
-		add_timer(yogurt_run_upper, 1*TIMER_HZ, TIMER_RUN_UNLIMITED);
+		yogurt_reset_time();
+		run_timer = yogurt_add_second_timer(yogurt_run, TASK_PRIO_HIGH | TASK_COALESCE);
 	}
 }
 
-static void yogurt_extras_timer(void) {
-	if (++control.seconds == 60) {
-		control.minutes++;
-		control.seconds = 0;
-	}
+/**
+ * Once a second timers may run up to a second late, so they share the whole
+ * second RTC tick. Their period stays exactly one second.
+ */
+static timer_id_t yogurt_add_second_timer(void (*cb)(void), uint8_t task_flags) {
+	timer_id_t id = add_deferred_timer(cb, TIMER_HZ, TIMER_RUN_UNLIMITED, task_flags);
+
+	if (id > 0)
+		timer_set_slack(id, TIMER_SLACK_SECOND);
+	return id;
+}
+
+/**
+ * Count the time in the current state from the monotonic clock rather than
+ * from the number of timer runs, so a late or coalesced run does not lose a
+ * second. The once a second timers run on whole second ticks and start is
+ * one too, so a run is a whole number of seconds after start plus its
+ * latency: truncating gives each second exactly once, and seconds == 0 once
+ * a minute.
+ */
+static void yogurt_update_time(void) {
+	uint32_t seconds = (timer_now() - control.start) / TIMER_HZ;
+
+	control.minutes = seconds / 60;
+	control.seconds = seconds % 60;
+}
 
-	task_schedule(yogurt_extras);
+/**
+ * Restart the time at the last whole second tick, the tick the once a
+ * second timers run on (TIMER_SLACK_SECOND).
+ */
+static void yogurt_reset_time(void) {
+	control.start = timer_now() & ~(timer_time_t)(TIMER_HZ-1);
+	control.minutes = 0;
+	control.seconds = 0;
 }
 
+/**
+ * Runs every second (as a task) while the timer or thermometer is shown.
+ */
 static void yogurt_extras(void) {
 	int16_t n1 = 0,n2 = 0;
 	int16_t temp = 0;
 	int8_t error = 0;
 
+	yogurt_update_time();
+
 	if (extras.timer) {
 		int16_t minutes;
 		uint8_t seconds;
@@ -159,33 +210,26 @@ static void yogurt_extras(void) {
 		printf("Err");
 	}
 
-	if (!extras.timer && !extras.thermo)
-		del_timer(yogurt_extras_timer);
-}
-
-/**
- * This runs via timer
- */
-static void yogurt_run_upper() {
-	if (++control.seconds == 60) {
-		control.minutes++;
-		control.seconds = 0;
+	if (!extras.timer && !extras.thermo) {
+		cancel_timer(extras_timer);
+		extras_timer = 0;
 	}
-
-	task_schedule(yogurt_run_lower);
 }
 
 /**
- * This runs after yogurt_run_upper() -- outside of timer context
+ * Control loop: runs every second (as a task) while a cycle is running.
  */
-static void yogurt_run_lower() {
+static void yogurt_run() {
 	if (control.state == YOGURT_STATE_IDLE) {
-		del_timer(yogurt_run_upper);
+		cancel_timer(run_timer);
+		run_timer = 0;
 		ssr_off();
 		clear();
 		return;
 	}
 
+	yogurt_update_time();
+
 	int16_t temp;
 	int8_t error = yogurt_temperature_control(&temp);
 
@@ -209,15 +253,28 @@ static void yogurt_run_lower() {
 		if (temp_in_interval(control.cycle.temperature,control.last_temp,temp)) {
 			yogurt_print_status(temp,control.cycle.minutes,control.seconds);
 			yogurt_alarm();
-			control.minutes = 0;
-			control.seconds = 0;
+			yogurt_reset_time();
 			control.integral = 0;
 			control.state = YOGURT_STATE_MAINTAIN;
 		}
 	}
 
 	control.last_temp = temp;
-	debug_write(&control, sizeof(control));
+	yogurt_report();
+}
+
+/**
+ * Write the control state to the debug port. The record is filled in place
+ * in a buffer from debug_alloc(), which debug_send() then queues as is.
+ */
+static void yogurt_report(void) {
+	yogurt_state_t *report = debug_alloc();
+
+	DEBUG_CHECK_LEN(*report);
+	if (report != NULL) {
+		*report = control;
+		debug_send(report, sizeof(*report));
+	}
 }
 
 static inline uint8_t temp_in_interval(int16_t temp, int16_t a, int16_t b) {
@@ -363,8 +420,10 @@ static void yogurt_clear_state(void) {
 	extras.timer = 0;
 	extras.thermo = 0;
 	extras.alarm = 0;
-	del_timer(yogurt_run_upper);
-	del_timer(yogurt_extras_timer);
+	cancel_timer(run_timer);
+	cancel_timer(start_timer);
+	cancel_timer(extras_timer);
+	run_timer = start_timer = extras_timer = 0;
 	clear();
 	alarm_off();
 }
@@ -421,10 +480,16 @@ static void yogurt_keyhandler_idle(char key) {
 			control.cycle.minutes = 60*hours + minutes;
 			// --> dirty as fuck
 			if (extras.timer) {
-				del_timer(yogurt_extras_timer);
-				add_timer(yogurt_extras_timer, TIMER_HZ, TIMER_RUN_UNLIMITED);
-				control.minutes = 0;
-				control.seconds = 0;
+				//'c' cancelled the extras timer: add it again
+				extras_timer = yogurt_add_second_timer(yogurt_extras, TASK_PRIO_LOW | TASK_COALESCE);
+				if (extras_timer < 0) {
+					extras_timer = 0;
+					extras.timer = 0;
+					clear();
+					printf("Err");
+				} else {
+					yogurt_reset_time();
+				}
 			} else {
 				yogurt_start();
 			}
@@ -438,17 +503,19 @@ static void yogurt_keyhandler_idle(char key) {
 		extras.thermo ^= 1;
 
 		if (!extras.timer) {
-			del_timer(yogurt_extras_timer);
+			cancel_timer(extras_timer);
+			extras_timer = 0;
 			clear();
 		}
 		
 		if (extras.thermo && !extras.timer)
-			add_timer(yogurt_extras_timer, TIMER_HZ, TIMER_RUN_UNLIMITED);
+			extras_timer = yogurt_add_second_timer(yogurt_extras, TASK_PRIO_LOW | TASK_COALESCE);
 
 	} else if (key == 'c') {
 		extras.timer ^= 1;
 
-		del_timer(yogurt_extras_timer);
+		cancel_timer(extras_timer);
+		extras_timer = 0;
 		clear();
 
 		if (extras.timer) {
@@ -456,7 +523,7 @@ static void yogurt_keyhandler_idle(char key) {
 			step = 2;
 			digitreader_init(4, yogurt_timeinput_print);
 		} else if (extras.thermo) {
-			add_timer(yogurt_extras_timer, TIMER_HZ, TIMER_RUN_UNLIMITED);
+			extras_timer = yogurt_add_second_timer(yogurt_extras, TASK_PRIO_LOW | TASK_COALESCE);
 		}
 	}
 }